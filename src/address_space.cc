@@ -0,0 +1,104 @@
+#include "address_space.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
+
+bool AddressSpace::LoadFromProc(pid_t pid, bool data) {
+  char maps_filename[32];
+  snprintf(maps_filename, 32, "/proc/%d/maps", pid);
+
+  FILE *maps_file = fopen(maps_filename, "r");
+  if (maps_file == NULL) return false;
+
+  mappings_.clear();
+
+  char *line = NULL;
+  size_t len = 0;
+  while (getline(&line, &len, maps_file) != EOF) {
+    uintptr_t start_addr;
+    uintptr_t end_addr;
+    char permissions[5];
+    uint64_t offset;
+    char device[32];
+    long long inode;
+    char mapped_file[256];
+
+    int fields = sscanf(line, "%lx-%lx %4s %lx %31s %lld %255s", &start_addr,
+                        &end_addr, permissions, &offset, device, &inode,
+                        mapped_file);
+
+    if (data) {
+      if (fields < 6 || permissions[2] == 'x') continue;
+      if (fields < 7) strcpy(mapped_file, "//anon");
+    } else if (fields < 7 || mapped_file[0] != '/') {
+      // Anonymous mappings have no file name and are never symbolized
+      continue;
+    }
+
+    AddMapping(start_addr, end_addr - start_addr, offset, mapped_file);
+  }
+
+  free(line);
+  fclose(maps_file);
+  return true;
+}
+
+void AddressSpace::AddMapping(uintptr_t start, uint64_t len, uint64_t pgoff,
+                              const char *filename) {
+  uintptr_t end = start + len;
+
+  // The first mapping that ends after start is the first one that can overlap
+  auto first = std::upper_bound(
+      mappings_.begin(), mappings_.end(), start,
+      [](uintptr_t addr, const Mapping &m) { return addr < m.end; });
+  auto last = first;
+  while (last != mappings_.end() && last->start < end) ++last;
+
+  // Keep the parts of overlapped mappings that stick out on either side
+  std::vector<Mapping> replacement;
+  if (first != last && first->start < start) {
+    Mapping left = *first;
+    left.end = start;
+    replacement.push_back(left);
+  }
+  replacement.push_back({start, end, pgoff, filename});
+  if (first != last && std::prev(last)->end > end) {
+    Mapping right = *std::prev(last);
+    right.pgoff += end - right.start;
+    right.start = end;
+    replacement.push_back(right);
+  }
+
+  auto pos = mappings_.erase(first, last);
+  mappings_.insert(pos, replacement.begin(), replacement.end());
+}
+
+bool AddressSpace::Overwrites(uintptr_t start, uint64_t len, uint64_t pgoff,
+                              const char *filename) const {
+  uintptr_t end = start + len;
+  auto it = std::upper_bound(
+      mappings_.begin(), mappings_.end(), start,
+      [](uintptr_t addr, const Mapping &m) { return addr < m.end; });
+  for (; it != mappings_.end() && it->start < end; ++it) {
+    // Both map their first common address to the same file offset, or not
+    uintptr_t common = std::max(start, it->start);
+    if (it->filename != filename ||
+        it->pgoff + (common - it->start) != pgoff + (common - start)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const Mapping *AddressSpace::FindMapping(uintptr_t addr) const {
+  auto it = std::upper_bound(
+      mappings_.begin(), mappings_.end(), addr,
+      [](uintptr_t addr, const Mapping &m) { return addr < m.start; });
+  if (it == mappings_.begin()) return NULL;
+  --it;
+  return addr < it->end ? &*it : NULL;
+}
@@ -0,0 +1,52 @@
+#ifndef ADDRESS_SPACE_HH
+#define ADDRESS_SPACE_HH
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+// One file-backed region of a process' virtual memory
+struct Mapping {
+  uintptr_t start;       // first address of the region
+  uintptr_t end;         // one past the last address of the region
+  uint64_t pgoff;        // file offset mapped at start
+  std::string filename;  // path of the mapped file
+};
+
+// An in-memory copy of a process' executable mappings. It is seeded once from
+// /proc/<pid>/maps and then kept up to date from PERF_RECORD_MMAP2 records, so
+// that resolving a sample never has to touch /proc (and still works after the
+// sampled thread has exited).
+class AddressSpace {
+ public:
+  // Replace the contents with the mappings listed in /proc/<pid>/maps: the
+  // file-backed ones, or with data set, every one that is not executable,
+  // anonymous ones named //anon as in PERF_RECORD_MMAP
+  // Return false if the maps file could not be read
+  bool LoadFromProc(pid_t pid, bool data = false);
+
+  // Insert a mapping, trimming or replacing whatever it overlaps
+  void AddMapping(uintptr_t start, uint64_t len, uint64_t pgoff,
+                  const char *filename);
+
+  // Return true if inserting the mapping would change what an address that is
+  // mapped already maps to: another file, or another offset in the same file
+  bool Overwrites(uintptr_t start, uint64_t len, uint64_t pgoff,
+                  const char *filename) const;
+
+  // Return the mapping containing addr, or NULL if there is none
+  const Mapping *FindMapping(uintptr_t addr) const;
+
+  // Forget every mapping (e.g. after the process called exec)
+  void Clear() { mappings_.clear(); }
+
+  size_t size() const { return mappings_.size(); }
+  const std::vector<Mapping> &mappings() const { return mappings_; }
+
+ private:
+  std::vector<Mapping> mappings_;  // sorted by start, never overlapping
+};
+
+#endif  // ADDRESS_SPACE_HH
@@ -0,0 +1,122 @@
+#include "calling_context_tree.hh"
+
+#include <linux/perf_event.h>
+
+constexpr uint32_t CallingContextTree::kRoot;
+constexpr uint32_t CallingContextTree::kNone;
+
+uint32_t CallingContextTree::Child(uint32_t parent, uint64_t key) {
+  uint32_t prev = kNone;
+  for (uint32_t i = nodes_[parent].first_child; i != kNone;
+       i = nodes_[i].next_sibling) {
+    if (nodes_[i].key == key) {
+      // Move the child to the front of the list
+      if (prev != kNone) {
+        nodes_[prev].next_sibling = nodes_[i].next_sibling;
+        nodes_[i].next_sibling = nodes_[parent].first_child;
+        nodes_[parent].first_child = i;
+      }
+      return i;
+    }
+    prev = i;
+  }
+
+  uint32_t child = nodes_.size();
+  nodes_.push_back({key, 0, parent, kNone, nodes_[parent].first_child});
+  nodes_[parent].first_child = child;
+  return child;
+}
+
+void CallingContextTree::AddStack(const uint64_t *frames, size_t num_frames,
+                                  uint64_t count) {
+  uint32_t node = kRoot;
+  for (size_t i = num_frames; i > 0; i--) {
+    // Skip the PERF_CONTEXT_* markers perf puts between kernel and user
+    // frames
+    if (frames[i - 1] >= PERF_CONTEXT_MAX) continue;
+    node = Child(node, frames[i - 1]);
+  }
+  nodes_[node].count += count;
+  total_ += count;
+}
+
+void CallingContextTree::MergeSubtree(
+    const CallingContextTree &other, uint32_t from, uint32_t to,
+    const std::function<uint64_t(uint64_t)> *map) {
+  // Walk other depth first with an explicit stack; deep recursion in the
+  // profiled program must not turn into deep recursion here
+  std::vector<std::pair<uint32_t, uint32_t>> pending;
+  pending.push_back({from, to});
+  while (!pending.empty()) {
+    uint32_t src = pending.back().first;
+    uint32_t dst = pending.back().second;
+    pending.pop_back();
+
+    nodes_[dst].count += other.nodes_[src].count;
+    total_ += other.nodes_[src].count;
+
+    for (uint32_t c = other.nodes_[src].first_child; c != kNone;
+         c = other.nodes_[c].next_sibling) {
+      uint64_t key = map ? (*map)(other.nodes_[c].key) : other.nodes_[c].key;
+      pending.push_back({c, Child(dst, key)});
+    }
+  }
+}
+
+void CallingContextTree::Merge(const CallingContextTree &other) {
+  MergeSubtree(other, kRoot, kRoot, NULL);
+}
+
+void CallingContextTree::MergeUnder(uint64_t key,
+                                    const CallingContextTree &other) {
+  MergeSubtree(other, kRoot, Child(kRoot, key), NULL);
+}
+
+CallingContextTree CallingContextTree::Remap(
+    const std::function<uint64_t(uint64_t)> &map) const {
+  CallingContextTree result;
+  result.MergeSubtree(*this, kRoot, kRoot, &map);
+  return result;
+}
+
+std::unordered_map<uint64_t, FunctionCost> CallingContextTree::Costs() const {
+  // A child always comes after its parent in nodes_, so walking backwards
+  // sees a whole subtree before its root
+  std::vector<uint64_t> subtree(nodes_.size());
+  for (size_t i = nodes_.size(); i-- > 1;) {
+    subtree[i] += nodes_[i].count;
+    subtree[nodes_[i].parent] += subtree[i];
+  }
+
+  // Depth-first walk that tracks how often each key is on the current path;
+  // only the outermost occurrence of a key adds to its inclusive cost
+  std::unordered_map<uint64_t, FunctionCost> costs;
+  std::unordered_map<uint64_t, uint32_t> on_path;
+  std::vector<std::pair<uint32_t, bool>> pending;  // (node, leaving)
+  for (uint32_t c = nodes_[kRoot].first_child; c != kNone;
+       c = nodes_[c].next_sibling) {
+    pending.push_back({c, false});
+  }
+  while (!pending.empty()) {
+    uint32_t n = pending.back().first;
+    bool leaving = pending.back().second;
+    pending.pop_back();
+
+    const Node &node = nodes_[n];
+    if (leaving) {
+      on_path[node.key]--;
+      continue;
+    }
+
+    FunctionCost &cost = costs[node.key];
+    cost.exclusive += node.count;
+    if (on_path[node.key]++ == 0) cost.inclusive += subtree[n];
+
+    pending.push_back({n, true});
+    for (uint32_t c = node.first_child; c != kNone;
+         c = nodes_[c].next_sibling) {
+      pending.push_back({c, false});
+    }
+  }
+  return costs;
+}
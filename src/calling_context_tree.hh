@@ -0,0 +1,83 @@
+#ifndef CALLING_CONTEXT_TREE_HH
+#define CALLING_CONTEXT_TREE_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+// Exclusive and inclusive sample counts of one function
+struct FunctionCost {
+  uint64_t exclusive = 0;  // samples taken in the function itself
+  uint64_t inclusive = 0;  // samples with the function anywhere on the stack
+};
+
+// A calling-context tree: one node per distinct call path, holding the
+// number of samples whose stack ended exactly at that path. Every frame is
+// identified by a 64-bit key, which is a raw instruction pointer while
+// collecting in deferred mode and a symbol id otherwise.
+//
+// All nodes live in one array and refer to each other by index. Children of
+// a node form a singly linked list that is kept in most-recently-used order,
+// so following the hot path of a loop usually takes one step per frame.
+class CallingContextTree {
+ public:
+  struct Node {
+    uint64_t key;           // frame this node stands for
+    uint64_t count;         // samples whose stack ended here
+    uint32_t parent;        // index of the caller's node
+    uint32_t first_child;   // index of the first callee, or kNone
+    uint32_t next_sibling;  // index of the next callee of parent, or kNone
+  };
+
+  static constexpr uint32_t kRoot = 0;
+  static constexpr uint32_t kNone = UINT32_MAX;
+
+  CallingContextTree() { nodes_.push_back({0, 0, kNone, kNone, kNone}); }
+
+  // Add count samples of a stack given leaf first, the order perf reports a
+  // callchain in
+  void AddStack(const uint64_t *frames, size_t num_frames, uint64_t count = 1);
+
+  // Add every stack of other to this tree
+  void Merge(const CallingContextTree &other);
+
+  // Add every stack of other to this tree, below an extra outermost frame
+  // with the given key (e.g. one per thread, to build a whole-process tree)
+  void MergeUnder(uint64_t key, const CallingContextTree &other);
+
+  // Return a copy of the tree with every key replaced by map(key). Paths that
+  // become equal (e.g. two ips in the same function) are merged.
+  CallingContextTree Remap(const std::function<uint64_t(uint64_t)> &map) const;
+
+  // Return the cost of every key. A key that appears several times on one
+  // stack (recursion) only counts once towards its inclusive cost.
+  std::unordered_map<uint64_t, FunctionCost> Costs() const;
+
+  // Call fn(key) for every distinct key in the tree
+  template <typename Fn>
+  void ForEachKey(Fn fn) const {
+    for (size_t i = 1; i < nodes_.size(); i++) fn(nodes_[i].key);
+  }
+
+  const std::vector<Node> &nodes() const { return nodes_; }
+
+  // Number of samples in the tree
+  uint64_t total() const { return total_; }
+
+ private:
+  // Return the child of parent with the given key, adding it if needed
+  uint32_t Child(uint32_t parent, uint64_t key);
+
+  // Add every path under other's node from to this tree's node to
+  void MergeSubtree(const CallingContextTree &other, uint32_t from,
+                    uint32_t to,
+                    const std::function<uint64_t(uint64_t)> *map);
+
+  std::vector<Node> nodes_;  // nodes_[0] is the root
+  uint64_t total_ = 0;
+};
+
+#endif  // CALLING_CONTEXT_TREE_HH
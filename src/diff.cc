@@ -0,0 +1,225 @@
+#include "diff.hh"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+
+#include "flamegraph.hh"
+
+namespace {
+// Changes with a larger z score are taken to be real
+constexpr double kSignificantZ = 3;
+
+// Only this many of the largest function changes are printed
+constexpr size_t kMaxFunctions = 20;
+
+// Cycles and samples of a whole run
+struct Totals {
+  double cycles = 0;
+  double samples = 0;
+};
+
+// Change of one function or role between two runs
+struct Change {
+  std::string name;
+  double base = 0;    // normalized cost in the base run
+  double next = 0;    // normalized cost in the next run
+  double impact = 0;  // change in percent of the base run
+  double z = 0;       // only if both runs have a sample count
+};
+
+// Compare the cycles a and b of one function or role in two runs
+Change Compare(const std::string &name, double a, double b,
+               const Totals &base, const Totals &next,
+               DiffNormalization normalization) {
+  Change change;
+  change.name = name;
+  bool scored = base.samples > 0 && next.samples > 0;
+
+  // Samples each side stands for, at the mean period of its run
+  double sa = a * base.samples / base.cycles;
+  double sb = b * next.samples / next.cycles;
+  if (normalization == DIFF_BY_SHARE) {
+    // Two-proportion z test on the shares
+    change.base = 100 * a / base.cycles;
+    change.next = 100 * b / next.cycles;
+    change.impact = change.next - change.base;
+    double p = (sa + sb) / (base.samples + next.samples);
+    double se =
+        sqrt(p * (1 - p) * (1 / base.samples + 1 / next.samples));
+    if (scored && se > 0) {
+      change.z = (sb / next.samples - sa / base.samples) / se;
+    }
+  } else {
+    // Sample counts are Poisson, so the cycles of a side vary by their
+    // count times the square of the period
+    change.base = a;
+    change.next = b;
+    change.impact = 100 * (b - a) / base.cycles;
+    if (scored) {
+      double base_period = base.cycles / base.samples;
+      double next_period = next.cycles / next.samples;
+      double se = sqrt(sa * base_period * base_period +
+                       sb * next_period * next_period);
+      if (se > 0) change.z = (b - a) / se;
+    }
+  }
+  return change;
+}
+
+// Print the largest changes; without z scores (scored false), a dash stands
+// for each
+void PrintChanges(std::ostream &out, std::vector<Change> changes,
+                  size_t max_changes, DiffNormalization normalization,
+                  bool scored) {
+  std::sort(changes.begin(), changes.end(),
+            [](const Change &a, const Change &b) {
+              return fabs(a.impact) > fabs(b.impact);
+            });
+  const char *unit = normalization == DIFF_BY_SHARE ? "%" : "";
+  int precision = normalization == DIFF_BY_SHARE ? 2 : 0;
+  for (size_t i = 0; i < changes.size() && i < max_changes; i++) {
+    const Change &c = changes[i];
+    out << "    " << std::setprecision(precision) << std::setw(13) << c.base
+        << unit << " -> " << std::setw(13) << c.next << unit << "  "
+        << std::setprecision(2) << std::showpos
+        << std::setw(7) << c.impact << "%" << std::noshowpos << "  z ";
+    if (scored) {
+      out << std::setw(6) << c.z;
+    } else {
+      out << std::setw(6) << "-";
+    }
+    out << (fabs(c.z) >= kSignificantZ ? " *  " : "    ") << c.name
+        << std::endl;
+  }
+}
+}  // namespace
+
+bool ReadFoldedProfile(const std::string &path, Profile *profile) {
+  std::ifstream in(path);
+  if (!in) return false;
+
+  // Folded stacks only have counts. The number of samples they add up from
+  // cannot be told from them, as the period may vary (--freq), so it is
+  // only known from the file the profiler writes next to its own.
+  profile->samples = 0;
+  std::ifstream samples_file(path + FOLDED_SAMPLES_SUFFIX);
+  if (samples_file) {
+    std::string samples, of;
+    if (!(samples_file >> profile->samples >> samples >> of >>
+          profile->unit) ||
+        samples != "samples" || of != "of") {
+      return false;
+    }
+  }
+
+  std::map<std::string, uint64_t> &functions = profile->roles["all"];
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty()) continue;
+    size_t space = line.rfind(' ');
+    if (space == std::string::npos) return false;
+    char *end;
+    uint64_t count = strtoull(line.c_str() + space + 1, &end, 10);
+    if (*end != '\0' || end == line.c_str() + space + 1) return false;
+    size_t semicolon = line.rfind(';', space);
+    size_t start = semicolon == std::string::npos ? 0 : semicolon + 1;
+    functions[line.substr(start, space - start)] += count;
+  }
+  return true;
+}
+
+bool PrintDiff(std::ostream &out, const Profile &base, const Profile &next,
+               DiffNormalization normalization, double fail_above) {
+  // Cycles per function and role, over both runs
+  std::map<std::string, std::pair<double, double>> functions;
+  std::map<std::string, std::pair<double, double>> roles;
+  Totals base_totals;
+  Totals next_totals;
+  for (auto &r : base.roles) {
+    for (auto &f : r.second) {
+      functions[f.first].first += f.second;
+      roles[r.first].first += f.second;
+      base_totals.cycles += f.second;
+    }
+  }
+  for (auto &r : next.roles) {
+    for (auto &f : r.second) {
+      functions[f.first].second += f.second;
+      roles[r.first].second += f.second;
+      next_totals.cycles += f.second;
+    }
+  }
+  base_totals.samples = base.samples;
+  next_totals.samples = next.samples;
+  if (base_totals.cycles == 0 || next_totals.cycles == 0) {
+    out << "Nothing to compare: a run has no samples" << std::endl;
+    return false;
+  }
+  bool scored = base.samples > 0 && next.samples > 0;
+
+  auto print_samples = [&](const Profile &profile) {
+    if (profile.samples > 0) {
+      out << " in " << profile.samples << " samples";
+    } else {
+      out << " in an unknown number of samples";
+    }
+  };
+  out << std::fixed << std::setprecision(2);
+  out << "Base: " << static_cast<uint64_t>(base_totals.cycles) << " "
+      << base.unit;
+  print_samples(base);
+  out << std::endl;
+  out << "Next: " << static_cast<uint64_t>(next_totals.cycles) << " "
+      << next.unit;
+  print_samples(next);
+  out << " (" << std::showpos
+      << 100 * (next_totals.cycles / base_totals.cycles - 1) << "%"
+      << std::noshowpos << ")" << std::endl;
+  out << "Normalized by "
+      << (normalization == DIFF_BY_SHARE ? "share of each run's "
+                                         : "absolute ")
+      << base.unit;
+  if (scored) {
+    out << "; * marks changes with |z| >= " << kSignificantZ << std::endl;
+  } else {
+    out << "; no z scores, as folded stacks without a "
+        << FOLDED_SAMPLES_SUFFIX << " file have no sample count" << std::endl;
+  }
+
+  bool regressed = false;
+  std::vector<Change> function_changes;
+  for (auto &f : functions) {
+    function_changes.push_back(Compare(f.first, f.second.first,
+                                       f.second.second, base_totals,
+                                       next_totals, normalization));
+    const Change &c = function_changes.back();
+    if (fail_above >= 0 && c.impact > fail_above &&
+        (!scored || c.z >= kSignificantZ)) {
+      regressed = true;
+    }
+  }
+  out << "  Functions:" << std::endl;
+  PrintChanges(out, function_changes, kMaxFunctions, normalization, scored);
+
+  std::vector<Change> role_changes;
+  for (auto &r : roles) {
+    role_changes.push_back(Compare(r.first, r.second.first, r.second.second,
+                                   base_totals, next_totals, normalization));
+  }
+  out << "  Thread roles:" << std::endl;
+  PrintChanges(out, role_changes, role_changes.size(), normalization,
+               scored);
+
+  out.unsetf(std::ios::floatfield);
+  out << std::setprecision(6);
+  if (regressed) {
+    out << "Regression: a function got slower by more than " << fail_above
+        << "%" << std::endl;
+  }
+  return regressed;
+}
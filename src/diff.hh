@@ -0,0 +1,43 @@
+#ifndef DIFF_HH
+#define DIFF_HH
+
+#include <stdint.h>
+
+#include <map>
+#include <ostream>
+#include <string>
+
+// What a diff compares of one run: the cycles of every function in every
+// thread role. A role is a thread name, so the threads of two runs that do
+// the same work line up even though their ids differ.
+struct Profile {
+  std::map<std::string, std::map<std::string, uint64_t>> roles;
+  uint64_t samples = 0;  // number of samples the cycles come from, 0 if unknown
+  std::string unit = "cycles";  // what the sampled event counted
+};
+
+// Read the folded stacks (--folded or --folded-process) at path into
+// profile, with the innermost frame of every line as the function. Folded
+// stacks have no thread names, so every thread gets the same role. Only those
+// written by the profiler tell the number of samples and the unit, in the
+// file next to them (see FOLDED_SAMPLES_SUFFIX).
+// Return false if the file cannot be read or is not in the folded format
+bool ReadFoldedProfile(const std::string &path, Profile *profile);
+
+// How the cycles of two runs are made comparable
+enum DiffNormalization {
+  DIFF_BY_SHARE,   // share of the cycles of each run
+  DIFF_BY_CYCLES,  // absolute cycles, for runs of the same work
+};
+
+// Print the functions and thread roles whose cost changed between the base
+// and the next run, with the largest changes first. A change is measured in
+// percent of the base run's cycles, and comes with a z score of how unlikely
+// it is from sampling noise alone, unless a run has no sample count.
+// Return true if a function got significantly slower (or, without z scores,
+// just slower) by more than fail_above percent; never if fail_above is
+// negative
+bool PrintDiff(std::ostream &out, const Profile &base, const Profile &next,
+               DiffNormalization normalization, double fail_above);
+
+#endif  // DIFF_HH
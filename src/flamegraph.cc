@@ -0,0 +1,174 @@
+#include "flamegraph.hh"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace {
+using Node = CallingContextTree::Node;
+
+// Layout of the SVG, in pixels
+constexpr double kImageWidth = 1200;
+constexpr double kFrameHeight = 16;
+constexpr double kPadding = 10;
+constexpr double kTitleHeight = 30;
+constexpr double kFontWidth = 7;     // approximate width of one character
+constexpr double kMinFrameWidth = 0.1;  // narrower frames are not drawn
+
+// Return the children of node n sorted by name, the usual flame graph order
+std::vector<uint32_t> SortedChildren(const CallingContextTree &cct, uint32_t n,
+                                     const SymbolNames &names) {
+  const std::vector<Node> &nodes = cct.nodes();
+  std::vector<uint32_t> children;
+  for (uint32_t c = nodes[n].first_child; c != CallingContextTree::kNone;
+       c = nodes[c].next_sibling) {
+    children.push_back(c);
+  }
+  std::sort(children.begin(), children.end(), [&](uint32_t a, uint32_t b) {
+    return names.Name(nodes[a].key) < names.Name(nodes[b].key);
+  });
+  return children;
+}
+
+// Return the number of samples in the subtree of every node
+std::vector<uint64_t> SubtreeCounts(const CallingContextTree &cct) {
+  const std::vector<Node> &nodes = cct.nodes();
+  std::vector<uint64_t> subtree(nodes.size());
+  for (size_t i = nodes.size(); i-- > 0;) {
+    subtree[i] += nodes[i].count;
+    if (i != CallingContextTree::kRoot) subtree[nodes[i].parent] += subtree[i];
+  }
+  return subtree;
+}
+
+std::string EscapeXml(const std::string &text) {
+  std::string escaped;
+  for (char c : text) {
+    switch (c) {
+      case '<': escaped += "&lt;"; break;
+      case '>': escaped += "&gt;"; break;
+      case '&': escaped += "&amp;"; break;
+      case '"': escaped += "&quot;"; break;
+      default: escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// Pick a stable warm color for a function name
+std::string FrameColor(const std::string &name) {
+  size_t h = std::hash<std::string>()(name);
+  int r = 205 + h % 50;
+  int g = 60 + (h >> 8) % 170;
+  int b = (h >> 16) % 55;
+  return "rgb(" + std::to_string(r) + "," + std::to_string(g) + "," +
+         std::to_string(b) + ")";
+}
+}  // namespace
+
+void WriteFoldedStacks(std::ostream &out, const CallingContextTree &cct,
+                       const SymbolNames &names) {
+  const std::vector<Node> &nodes = cct.nodes();
+
+  // Depth-first walk that keeps the folded path of the current node in one
+  // string; lengths of the enclosing paths are kept to cut it back
+  std::string path;
+  std::vector<std::pair<uint32_t, size_t>> pending;  // (node, parent's length)
+  for (uint32_t c : SortedChildren(cct, CallingContextTree::kRoot, names)) {
+    pending.push_back({c, 0});
+  }
+  std::reverse(pending.begin(), pending.end());
+
+  while (!pending.empty()) {
+    uint32_t n = pending.back().first;
+    path.resize(pending.back().second);
+    pending.pop_back();
+
+    if (!path.empty()) path += ';';
+    path += names.Name(nodes[n].key);
+    if (nodes[n].count != 0) out << path << ' ' << nodes[n].count << '\n';
+
+    std::vector<uint32_t> children = SortedChildren(cct, n, names);
+    for (size_t i = children.size(); i > 0; i--) {
+      pending.push_back({children[i - 1], path.size()});
+    }
+  }
+}
+
+void WriteFoldedSamples(std::ostream &out, uint64_t samples,
+                        const std::string &unit) {
+  out << samples << " samples of " << unit << '\n';
+}
+
+void WriteFlameGraph(std::ostream &out, const CallingContextTree &cct,
+                     const SymbolNames &names, const std::string &title,
+                     const std::string &unit) {
+  const std::vector<Node> &nodes = cct.nodes();
+  std::vector<uint64_t> subtree = SubtreeCounts(cct);
+  uint64_t total = subtree[CallingContextTree::kRoot];
+  double scale = total == 0 ? 0 : (kImageWidth - 2 * kPadding) / total;
+
+  // Frames are placed left to right inside their parent; collect the visible
+  // ones with their position first, since the image height depends on the
+  // deepest one
+  struct Frame {
+    uint32_t node;
+    double x;
+    size_t depth;
+  };
+  std::vector<Frame> frames;
+  std::vector<Frame> pending;
+  frames.push_back({CallingContextTree::kRoot, kPadding, 0});
+  pending.push_back(frames.back());
+  size_t max_depth = 0;
+  while (!pending.empty()) {
+    Frame f = pending.back();
+    pending.pop_back();
+    double x = f.x;
+    for (uint32_t c : SortedChildren(cct, f.node, names)) {
+      double width = subtree[c] * scale;
+      if (width >= kMinFrameWidth) {
+        frames.push_back({c, x, f.depth + 1});
+        pending.push_back(frames.back());
+        max_depth = std::max(max_depth, f.depth + 1);
+      }
+      x += width;
+    }
+  }
+
+  double height = kTitleHeight + (max_depth + 1) * kFrameHeight + 2 * kPadding;
+  out << "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+      << "<svg version=\"1.1\" width=\"" << kImageWidth << "\" height=\""
+      << height << "\" xmlns=\"http://www.w3.org/2000/svg\">\n"
+      << "<style>text { font-family: monospace; font-size: 12px; } "
+      << "rect:hover { stroke: black; }</style>\n"
+      << "<rect width=\"100%\" height=\"100%\" fill=\"rgb(240,240,230)\"/>\n"
+      << "<text x=\"" << kImageWidth / 2 << "\" y=\"" << kTitleHeight - 8
+      << "\" text-anchor=\"middle\" font-size=\"16px\">" << EscapeXml(title)
+      << "</text>\n";
+
+  for (const Frame &f : frames) {
+    bool root = f.node == CallingContextTree::kRoot;
+    std::string name = root ? "all" : names.Name(nodes[f.node].key);
+    double width = subtree[f.node] * scale;
+    // The root is drawn at the bottom, callees on top of their callers
+    double y = height - kPadding - (f.depth + 1) * kFrameHeight;
+
+    out << "<g><title>" << EscapeXml(name) << " (" << subtree[f.node]
+        << " " << EscapeXml(unit) << ", " << 100.0 * subtree[f.node] / total << "%)</title>"
+        << "<rect x=\"" << f.x << "\" y=\"" << y << "\" width=\"" << width
+        << "\" height=\"" << kFrameHeight - 1 << "\" fill=\""
+        << FrameColor(name) << "\" rx=\"2\"/>";
+
+    // Only label frames wide enough for a few characters
+    size_t fit = width / kFontWidth;
+    if (fit >= 3) {
+      std::string label =
+          name.size() <= fit ? name : name.substr(0, fit - 2) + "..";
+      out << "<text x=\"" << f.x + 3 << "\" y=\"" << y + kFrameHeight - 4
+          << "\">" << EscapeXml(label) << "</text>";
+    }
+    out << "</g>\n";
+  }
+  out << "</svg>\n";
+}
@@ -0,0 +1,38 @@
+#ifndef FLAMEGRAPH_HH
+#define FLAMEGRAPH_HH
+
+#include <stdint.h>
+
+#include <ostream>
+#include <string>
+
+#include "calling_context_tree.hh"
+#include "symbol_names.hh"
+
+// Write every call path of cct that has samples as one line in the folded
+// stack format used by flame graph tools: "outer;...;inner count"
+// Keys of cct must be ids in names
+void WriteFoldedStacks(std::ostream &out, const CallingContextTree &cct,
+                       const SymbolNames &names);
+
+// Folded stacks only have counts. How many samples they add up from (which a
+// varying period, --freq, hides) and what they count go to a file of their
+// own next to them, named with this suffix, so flame graph tools still get
+// nothing but stack lines.
+constexpr char FOLDED_SAMPLES_SUFFIX[] = ".samples";
+
+// Write the contents of the FOLDED_SAMPLES_SUFFIX file of folded stacks that
+// add up from samples samples, counted in unit: "<samples> samples of <unit>"
+void WriteFoldedSamples(std::ostream &out, uint64_t samples,
+                        const std::string &unit);
+
+// Write cct as a self-contained SVG flame graph. The output is generated
+// straight from the tree, so its size depends on the number of distinct call
+// paths wide enough to see, not on the number of samples.
+// Keys of cct must be ids in names, and its weights are counted in unit,
+// like "cycles"
+void WriteFlameGraph(std::ostream &out, const CallingContextTree &cct,
+                     const SymbolNames &names, const std::string &title,
+                     const std::string &unit);
+
+#endif  // FLAMEGRAPH_HH
@@ -1,117 +1,518 @@
 #if !defined(INSPECT_H)
 #define INSPECT_H
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <cxxabi.h>
 
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <elf/elf++.hh>
 #include <dwarf/dwarf++.hh>
 
-static const char* find_subprogram(intptr_t search_addr, const dwarf::die& node) {
-  if(node.tag == dwarf::DW_TAG::subprogram &&
-      node.has(dwarf::DW_AT::low_pc) &&
-      node.has(dwarf::DW_AT::high_pc) &&
-      node.has(dwarf::DW_AT::name)) {
-    
-    intptr_t low_pc = node[dwarf::DW_AT::low_pc].as_address();
-    intptr_t high_pc = low_pc + node[dwarf::DW_AT::high_pc].as_sconstant();
-    if(low_pc <= search_addr && high_pc > search_addr) {
-      return node[dwarf::DW_AT::name].as_cstr();
+#include "address_space.hh"
+
+// A flat index of every function in one ELF file: the named subprograms of
+// its DWARF information, then the function symbols of its .symtab and .dynsym
+// for code without DWARF (stripped binaries, most shared libraries). The DIE
+// tree is walked once when the index is built; lookups are a binary search
+// over a dense array of start addresses, so their cost only grows with
+// log(number of functions) instead of the size of the tree.
+class SymbolIndex {
+ public:
+  SymbolIndex() {}
+
+  // dw may be NULL if the file has no DWARF information
+  SymbolIndex(const dwarf::dwarf* dw, const elf::elf& f) {
+    std::vector<Range> ranges;
+    std::unordered_map<std::string, uint32_t> name_ids;
+    if(dw != NULL) {
+      for(auto& cu: dw->compilation_units()) {
+        add_subprograms(cu.root(), ranges, name_ids);
+      }
+    }
+    add_symbols(f, ranges, name_ids);
+
+    // The sort is stable, so DWARF names win over symbols at the same address
+    std::stable_sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) {
+      return a.low_pc < b.low_pc;
+    });
+
+    starts_.reserve(ranges.size());
+    extents_.reserve(ranges.size());
+    for(auto& r: ranges) {
+      // Drop duplicate descriptions of the same function (e.g. from a header
+      // compiled into several units); the first one wins.
+      if(!starts_.empty() && starts_.back() == r.low_pc) continue;
+      starts_.push_back(r.low_pc);
+      extents_.push_back({static_cast<uint32_t>(r.high_pc - r.low_pc), r.symbol_id});
     }
   }
 
-  for(auto& child: node) {
-    const char* result = find_subprogram(search_addr, child);
-    if(result != NULL) return result;
+  // Return the name of the function containing addr, or NULL if no function
+  // covers it
+  const char* lookup(uintptr_t addr) const {
+    // Find the last function starting at or before addr
+    auto it = std::upper_bound(starts_.begin(), starts_.end(), addr);
+    if(it == starts_.begin()) return NULL;
+    size_t index = (it - starts_.begin()) - 1;
+
+    if(addr - starts_[index] >= extents_[index].size) return NULL;
+    return names_[extents_[index].symbol_id].c_str();
   }
 
-  return NULL;
-}
+  size_t size() const { return starts_.size(); }
+
+  // Write the index to path, replacing the file only once it is complete
+  // Return false if it could not be written
+  bool save(const std::string& path) const {
+    std::string tmp = path + "." + std::to_string(getpid());
+    {
+      std::ofstream out(tmp, std::ios::binary);
+      uint64_t counts[2] = {starts_.size(), names_.size()};
+      out.write(cache_magic(), kCacheMagicSize);
+      out.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+      out.write(reinterpret_cast<const char*>(starts_.data()), starts_.size() * sizeof(uintptr_t));
+      out.write(reinterpret_cast<const char*>(extents_.data()), extents_.size() * sizeof(Extent));
+      for(auto& name: names_) {
+        uint32_t length = name.size();
+        out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        out.write(name.data(), length);
+      }
+      if(!out) {
+        unlink(tmp.c_str());
+        return false;
+      }
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+  }
+
+  // Replace the index with the one saved at path
+  // Return false if there is no valid index at path
+  bool load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[kCacheMagicSize];
+    uint64_t counts[2];
+    if(!in.read(magic, sizeof(magic)) || memcmp(magic, cache_magic(), kCacheMagicSize) != 0 ||
+       !in.read(reinterpret_cast<char*>(counts), sizeof(counts))) {
+      return false;
+    }
+
+    // A truncated or corrupt file must not make us allocate what it does not
+    // hold: every entry takes an address and an extent, every name at least
+    // its length
+    in.seekg(0, std::ios::end);
+    uint64_t left = static_cast<uint64_t>(in.tellg()) - kCacheMagicSize - sizeof(counts);
+    in.seekg(kCacheMagicSize + sizeof(counts));
+    const uint64_t entry_size = sizeof(uintptr_t) + sizeof(Extent);
+    if(!in || counts[0] > left / entry_size ||
+       counts[1] > (left - counts[0] * entry_size) / sizeof(uint32_t)) {
+      return false;
+    }
+    left -= counts[0] * entry_size + counts[1] * sizeof(uint32_t);
+
+    starts_.resize(counts[0]);
+    extents_.resize(counts[0]);
+    names_.resize(counts[1]);
+    in.read(reinterpret_cast<char*>(starts_.data()), starts_.size() * sizeof(uintptr_t));
+    in.read(reinterpret_cast<char*>(extents_.data()), extents_.size() * sizeof(Extent));
+    for(auto& name: names_) {
+      uint32_t length = 0;
+      in.read(reinterpret_cast<char*>(&length), sizeof(length));
+      if(!in || length > left) {
+        *this = SymbolIndex();
+        return false;
+      }
+      left -= length;
+      name.resize(length);
+      in.read(&name[0], length);
+    }
+
+    bool valid = static_cast<bool>(in);
+    for(auto& e: extents_) valid = valid && e.symbol_id < names_.size();
+    if(!valid) *this = SymbolIndex();
+    return valid;
+  }
+
+ private:
+  // Start of a saved index; bump the version when the layout changes
+  static const char* cache_magic() { return "GPSYMS01"; }
+  static constexpr size_t kCacheMagicSize = 8;
 
-static const char* address_to_function(pid_t pid, void* addr) {
-  // Map of dwarf information by filename
-  static std::map<std::string, dwarf::dwarf> dwarf_map;
-
-  // Open the /proc/<pid>/maps file for processing
-  char maps_filename[32];
-  snprintf(maps_filename, 32, "/proc/%d/maps", pid);
-  
-  FILE* maps_file = fopen(maps_filename, "r");
-  if(maps_file == NULL) return NULL; 
-
-  // Read the maps file until we find a matching entry or reach the end
-  intptr_t search_address = (intptr_t)addr;
-  intptr_t start_addr;
-  intptr_t end_addr;
-  char permissions[5];
-  size_t offset;
-  char device[32];
-  long long inode;
-  char mapped_file[256];
-
-  char* line = NULL;
-  size_t len = 0;
-
-  bool match_found = false;
-
-  while(!match_found && getline(&line, &len, maps_file) != EOF) {
-    sscanf(line, "%lx-%lx %s %lx %s %lld %s", 
-                 &start_addr, &end_addr, permissions, &offset, device, &inode, mapped_file);
-
-    if(search_address >= start_addr && search_address < end_addr) {
-      match_found = true;
+  struct Range {
+    uintptr_t low_pc;
+    uintptr_t high_pc;
+    uint32_t symbol_id;
+  };
+
+  // Only the start addresses are touched by the binary search, so they are
+  // kept in their own array; the rest of each entry is read once at the end.
+  struct Extent {
+    uint32_t size;
+    uint32_t symbol_id;
+  };
+
+  void add_subprograms(const dwarf::die& node, std::vector<Range>& ranges,
+                       std::unordered_map<std::string, uint32_t>& name_ids) {
+    if(node.tag == dwarf::DW_TAG::subprogram &&
+        node.has(dwarf::DW_AT::name) &&
+        (node.has(dwarf::DW_AT::low_pc) || node.has(dwarf::DW_AT::ranges))) {
+
+      std::string name = node[dwarf::DW_AT::name].as_string();
+      auto id = name_ids.find(name);
+      if(id == name_ids.end()) {
+        id = name_ids.emplace(name, names_.size()).first;
+        names_.push_back(name);
+      }
+
+      // die_pc_range handles both forms of DW_AT_high_pc as well as
+      // non-contiguous functions described by DW_AT_ranges
+      for(auto& r: dwarf::die_pc_range(node)) {
+        if(r.high > r.low) {
+          ranges.push_back({r.low, r.high, id->second});
+        }
+      }
+    }
+
+    for(auto& child: node) {
+      add_subprograms(child, ranges, name_ids);
     }
   }
 
-  free(line);
-  fclose(maps_file);
+  void add_symbols(const elf::elf& f, std::vector<Range>& ranges,
+                   std::unordered_map<std::string, uint32_t>& name_ids) {
+    for(auto& sec: f.sections()) {
+      if(sec.get_hdr().type != elf::sht::symtab && sec.get_hdr().type != elf::sht::dynsym) {
+        continue;
+      }
+
+      for(auto sym: sec.as_symtab()) {
+        auto& data = sym.get_data();
+        // Skip undefined symbols, which are only references to other files
+        if((data.type() != elf::stt::func && data.type() != elf::stt::gnu_ifunc) ||
+           data.shnxd == 0 || data.size == 0) {
+          continue;
+        }
+
+        // Show C++ names the way DWARF would
+        std::string name = sym.get_name();
+        int status;
+        char* demangled = abi::__cxa_demangle(name.c_str(), NULL, NULL, &status);
+        if(demangled != NULL) {
+          name = demangled;
+          free(demangled);
+        }
 
-  // Return failure if there was no matching entry in /proc/<pid>/maps
-  if(!match_found) return NULL;
+        auto id = name_ids.find(name);
+        if(id == name_ids.end()) {
+          id = name_ids.emplace(name, names_.size()).first;
+          names_.push_back(name);
+        }
+        ranges.push_back({data.value, data.value + data.size, id->second});
+      }
+    }
+  }
 
-  auto d = dwarf_map.find(mapped_file);
+  std::vector<uintptr_t> starts_;   // sorted start address of each function
+  std::vector<Extent> extents_;     // size and name of each function
+  std::vector<std::string> names_;  // function names indexed by symbol id
+};
+
+// A flat index of the DWARF line tables of one ELF file, from instruction
+// address to source line. Like SymbolIndex it is built once and searched with
+// a binary search, so a lookup never walks a line program.
+class LineIndex {
+ public:
+  LineIndex() {}
+
+  explicit LineIndex(const dwarf::dwarf& dw) {
+    std::unordered_map<std::string, uint32_t> file_ids;
+    for(auto& cu: dw.compilation_units()) {
+      const dwarf::line_table& lt = cu.get_line_table();
+      if(!lt.valid()) continue;
+
+      for(auto& entry: lt) {
+        // The end of a sequence is the first address after it, which is not
+        // part of any line
+        if(entry.end_sequence) {
+          rows_.push_back({entry.address, kNoFile, 0});
+          continue;
+        }
+        auto id = file_ids.find(entry.file->path);
+        if(id == file_ids.end()) {
+          id = file_ids.emplace(entry.file->path, files_.size()).first;
+          files_.push_back(entry.file->path);
+        }
+        rows_.push_back({entry.address, id->second, entry.line});
+      }
+    }
+
+    // A sequence may start where another ends, so at the same address the
+    // end of a sequence sorts first and the line that starts there wins
+    std::stable_sort(rows_.begin(), rows_.end(), [](const Row& a, const Row& b) {
+      if(a.address != b.address) return a.address < b.address;
+      return a.file_id == kNoFile && b.file_id != kNoFile;
+    });
+  }
+
+  // Return the source file of the instruction at addr and store its line in
+  // line, or return NULL if no line covers addr
+  const char* lookup(uintptr_t addr, unsigned* line) const {
+    // Find the last row starting at or before addr
+    auto it = std::upper_bound(rows_.begin(), rows_.end(), addr,
+                               [](uintptr_t a, const Row& r) { return a < r.address; });
+    if(it == rows_.begin()) return NULL;
+    --it;
+
+    if(it->file_id == kNoFile) return NULL;
+    *line = it->line;
+    return files_[it->file_id].c_str();
+  }
+
+  size_t size() const { return rows_.size(); }
+
+ private:
+  static constexpr uint32_t kNoFile = UINT32_MAX;
+
+  struct Row {
+    uintptr_t address;  // first address of the row
+    uint32_t file_id;   // index into files_, or kNoFile past a sequence
+    uint32_t line;
+  };
+
+  std::vector<Row> rows_;           // sorted by address
+  std::vector<std::string> files_;  // source file paths indexed by file id
+};
+
+// A PT_LOAD segment, used to turn a file offset back into a link-time address
+struct load_segment {
+  uint64_t offset;
+  uint64_t filesz;
+  uintptr_t vaddr;
+};
+
+// Debug information for one ELF file, loaded the first time a sample lands in it
+struct loaded_elf {
+  elf::elf file;  // the separate debug file, if there is one
+  SymbolIndex index;
+  bool relocated;  // true for PIE executables and shared objects
+  std::vector<load_segment> segments;
+  std::unique_ptr<LineIndex> lines;  // built the first time a line is needed
+};
+
+// Return the GNU build id of f in hex, or "" if it has none
+static std::string elf_build_id(const elf::elf& f) {
+  const elf::section& note = f.get_section(".note.gnu.build-id");
+  if(!note.valid() || note.size() < 16) return "";
+
+  // An ELF note: name size, description size, type, name, then the id
+  const uint32_t* header = reinterpret_cast<const uint32_t*>(note.data());
+  size_t name_size = (header[0] + 3) & ~3;
+  size_t id_size = header[1];
+  if(12 + name_size + id_size > note.size()) return "";
+
+  const unsigned char* id =
+      reinterpret_cast<const unsigned char*>(note.data()) + 12 + name_size;
+  std::string hex;
+  for(size_t i = 0; i < id_size; i++) {
+    char byte[3];
+    snprintf(byte, sizeof(byte), "%02x", id[i]);
+    hex += byte;
+  }
+  return hex;
+}
+
+// Return the file the symbol index cached under key is in, creating the
+// cache directory ($XDG_CACHE_HOME/g-profiler or ~/.cache/g-profiler) if
+// needed, or "" if there is nowhere to cache it
+static std::string symbol_cache_path(const std::string& key) {
+  if(key.empty()) return "";
+
+  std::string dir;
+  const char* cache_home = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if(cache_home != NULL && cache_home[0] != '\0') {
+    dir = cache_home;
+  } else if(home != NULL && home[0] != '\0') {
+    dir = std::string(home) + "/.cache";
+    mkdir(dir.c_str(), 0755);
+  } else {
+    return "";
+  }
+  dir += "/g-profiler";
+  if(mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) return "";
+  return dir + "/" + key + ".syms";
+}
+
+// Return the ELF file at path, or an invalid one if it cannot be read or is
+// not ELF. The mmap loader takes over fd and closes it once mapped, so only
+// files it cannot map (empty or not regular) are closed here. mtime, if not
+// NULL, gets the file's modification time.
+static elf::elf open_elf(const std::string& path, time_t* mtime = NULL) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd == -1) return elf::elf();
+
+  struct stat st;
+  if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return elf::elf();
+  }
+  if(mtime != NULL) *mtime = st.st_mtime;
+
+  // The loader closes fd once it has mapped the file, and not if it throws
+  std::shared_ptr<elf::loader> loader;
+  try {
+    loader = elf::create_mmap_loader(fd);
+  } catch(const std::exception& e) {
+    close(fd);
+    return elf::elf();
+  }
+  try {
+    return elf::elf(loader);
+  } catch(const std::exception& e) {
+    // Not ELF, or truncated: treat it as having no symbols
+    return elf::elf();
+  }
+}
+
+// Return the debug information of the file mapped at addr, loading it the
+// first time, and store the address addr was linked at in link_address. With
+// need_lines, the line index of the file is built as well.
+// Return NULL if the file has no usable debug information or symbols
+static const loaded_elf* find_elf(const AddressSpace& space, void* addr,
+                                  uintptr_t* link_address, bool need_lines) {
+  // Map of dwarf information and symbol index by filename
+  static std::map<std::string, std::unique_ptr<loaded_elf>> dwarf_map;
+
+  // Deferred symbolization resolves from several threads. Loading is
+  // serialized; once loaded, an index is only ever read.
+  static std::mutex dwarf_map_lock;
+
+  uintptr_t search_address = (uintptr_t)addr;
+  const Mapping* mapping = space.FindMapping(search_address);
+
+  // Return failure if the address is not in any mapped file
+  if(mapping == NULL) return NULL;
+
+  std::unique_lock<std::mutex> lock(dwarf_map_lock);
+  auto d = dwarf_map.find(mapping->filename);
 
   if(d == dwarf_map.end()) {
-    int fd = open(mapped_file, O_RDONLY);
-    if(fd == -1) return NULL;
+    // Remember files without usable debug information too, so we do not try
+    // to load them again on every sample
+    d = dwarf_map.emplace(mapping->filename, std::unique_ptr<loaded_elf>()).first;
+
+    elf::elf f = open_elf(mapping->filename);
+    if(!f.valid()) return NULL;
 
-    elf::elf f(elf::create_mmap_loader(fd));
-    if(!f.valid()) {
-      close(fd);
-      return NULL;
+    // Distributions ship the symbols and DWARF of stripped binaries in
+    // separate files named by build id. Those have the same addresses.
+    // An index built from one is cached apart from the binary's own, under
+    // the debug file's modification time, so a debug file installed or
+    // updated later is read again.
+    std::string build_id = elf_build_id(f);
+    std::string cache_key = build_id;
+    elf::elf symbols = f;
+    if(build_id.size() > 2) {
+      std::string debug_path = "/usr/lib/debug/.build-id/" + build_id.substr(0, 2) + "/" +
+                               build_id.substr(2) + ".debug";
+      time_t mtime;
+      elf::elf debug_file = open_elf(debug_path, &mtime);
+      if(debug_file.valid()) {
+        symbols = debug_file;
+        cache_key += ".debug-" + std::to_string(mtime);
+      }
     }
 
-    // If this is a dynamically relocated executable, adjust our search address to the offset within the mapped section
-    if(f.get_hdr().type == elf::et::dyn) {
-      search_address -= start_addr;
+    // A binary with the same build id was indexed before. Otherwise index
+    // its DWARF information, if any, and its symbol tables.
+    SymbolIndex index;
+    std::string cache_path = symbol_cache_path(cache_key);
+    if(cache_path.empty() || !index.load(cache_path)) {
+      try {
+        dwarf::dwarf dw(dwarf::elf::create_loader(symbols));
+        index = SymbolIndex(&dw, symbols);
+      } catch(const dwarf::format_error& e) {
+        index = SymbolIndex(NULL, symbols);
+      }
+      if(!cache_path.empty()) index.save(cache_path);
     }
+    if(index.size() == 0) return NULL;
 
+    bool relocated = f.get_hdr().type == elf::et::dyn;
+    std::vector<load_segment> segments;
+    for(auto& seg: f.segments()) {
+      if(seg.get_hdr().type == elf::pt::load) {
+        segments.push_back({seg.get_hdr().offset, seg.get_hdr().filesz, seg.get_hdr().vaddr});
+      }
+    }
+
+    d->second.reset(new loaded_elf{symbols, std::move(index), relocated, segments,
+                                   std::unique_ptr<LineIndex>()});
+  }
 
+  if(!d->second) return NULL;
+  if(need_lines && !d->second->lines) {
+    // Line tables are only read for --annotate, so they are not cached
     try {
-      dwarf_map.emplace(mapped_file, dwarf::elf::create_loader(f));
-      d = dwarf_map.find(mapped_file);
-    } catch(dwarf::format_error e) {
-      return NULL;
+      dwarf::dwarf dw(dwarf::elf::create_loader(d->second->file));
+      d->second->lines.reset(new LineIndex(dw));
+    } catch(const dwarf::format_error& e) {
+      d->second->lines.reset(new LineIndex());
     }
-
-    // Just to be sure, make sure we actually inserted
-    if(d == dwarf_map.end()) return NULL;
   }
+  lock.unlock();
 
-  for(auto cu: d->second.compilation_units()) {
-    const char* result = find_subprogram(search_address, cu.root());
-    if(result != NULL) return result;
+  // If this is a dynamically relocated executable, the load address is only
+  // known at run time. Go from the runtime address to the offset within the
+  // file, then to the address the segment holding that offset was linked at.
+  if(d->second->relocated) {
+    uint64_t file_offset = search_address - mapping->start + mapping->pgoff;
+    bool found = false;
+    for(auto& seg: d->second->segments) {
+      if(file_offset >= seg.offset && file_offset < seg.offset + seg.filesz) {
+        search_address = file_offset - seg.offset + seg.vaddr;
+        found = true;
+        break;
+      }
+    }
+    if(!found) return NULL;
   }
 
-  return NULL;
+  *link_address = search_address;
+  return d->second.get();
+}
+
+static const char* address_to_function(const AddressSpace& space, void* addr) {
+  uintptr_t link_address;
+  const loaded_elf* elf = find_elf(space, addr, &link_address, /*need_lines=*/false);
+  if(elf == NULL) return NULL;
+  return elf->index.lookup(link_address);
+}
+
+// Return the source file of the instruction at addr and store its line in
+// line, and the address it was linked at (as objdump shows it) in
+// link_address, or return NULL if there is no line information for it
+static const char* address_to_line(const AddressSpace& space, void* addr, unsigned* line,
+                                   uintptr_t* link_address) {
+  const loaded_elf* elf = find_elf(space, addr, link_address, /*need_lines=*/true);
+  if(elf == NULL) return NULL;
+  return elf->lines->lookup(*link_address, line);
 }
 
 #endif
@@ -0,0 +1,82 @@
+#ifndef IP_HISTOGRAM_HH
+#define IP_HISTOGRAM_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+// A compact open-addressing hash table from raw instruction pointer to
+// sample count. Adding a sample is a multiply, a shift and (almost always)
+// one cache line, with no allocation except when the table grows.
+class IpHistogram {
+ public:
+  IpHistogram() : slots_(kInitialCapacity), shift_(64 - kInitialBits) {}
+
+  // Add count samples at ip
+  void Add(uint64_t ip, uint64_t count = 1) {
+    if ((size_ + 1) * 2 > slots_.size()) Grow();
+    Insert(ip, count);
+    total_ += count;
+  }
+
+  // Call fn(ip, count) for every distinct ip, in no particular order
+  template <typename Fn>
+  void ForEach(Fn fn) const {
+    for (const Slot &s : slots_) {
+      if (s.count != 0) fn(s.ip, s.count);
+    }
+  }
+
+  size_t size() const { return size_; }    // number of distinct ips
+  uint64_t total() const { return total_; }  // sum of all counts
+
+ private:
+  static constexpr int kInitialBits = 6;
+  static constexpr size_t kInitialCapacity = 1 << kInitialBits;
+
+  // A slot is empty when its count is zero, so any ip (including 0) can be
+  // stored
+  struct Slot {
+    uint64_t ip;
+    uint64_t count;
+  };
+
+  void Insert(uint64_t ip, uint64_t count) {
+    size_t mask = slots_.size() - 1;
+    // Fibonacci hashing: the high bits of the product are well mixed even
+    // though nearby ips differ only in their low bits
+    size_t i = (ip * 0x9E3779B97F4A7C15ULL) >> shift_;
+    while (true) {
+      Slot &s = slots_[i];
+      if (s.count == 0) {
+        s.ip = ip;
+        s.count = count;
+        size_++;
+        return;
+      }
+      if (s.ip == ip) {
+        s.count += count;
+        return;
+      }
+      i = (i + 1) & mask;
+    }
+  }
+
+  void Grow() {
+    std::vector<Slot> old(slots_.size() * 2);
+    old.swap(slots_);
+    shift_--;
+    size_ = 0;
+    for (const Slot &s : old) {
+      if (s.count != 0) Insert(s.ip, s.count);
+    }
+  }
+
+  std::vector<Slot> slots_;  // capacity is always a power of two
+  int shift_;                // 64 - log2(capacity)
+  size_t size_ = 0;
+  uint64_t total_ = 0;
+};
+
+#endif  // IP_HISTOGRAM_HH
@@ -0,0 +1,89 @@
+#include "live_top.hh"
+
+#include <iomanip>
+
+void LiveTop::Table::Add(uint32_t id, double weight) {
+  double &current = weights_[id];
+  if (current != 0) order_.erase({current, id});
+  current += weight;
+  order_.insert({current, id});
+  total_ += weight;
+}
+
+void LiveTop::Table::Rescale(double factor, double min) {
+  // The order is the same after scaling, so the entries go in at the end
+  Order order;
+  total_ = 0;
+  for (auto &entry : order_) {
+    double weight = entry.first * factor;
+    if (weight < min) {
+      weights_.erase(entry.second);
+      continue;
+    }
+    weights_[entry.second] = weight;
+    order.insert(order.end(), {weight, entry.second});
+    total_ += weight;
+  }
+  order_.swap(order);
+}
+
+void LiveTop::Add(pid_t tid, uint32_t key, uint64_t weight) {
+  double scaled = weight * scale_;
+  functions_.Add(key, scaled);
+  threads_.Add(static_cast<uint32_t>(tid), scaled);
+  thread_functions_[tid].Add(key, scaled);
+  refresh_weight_ += weight;
+}
+
+void LiveTop::Decay() {
+  refresh_weight_ = 0;
+  scale_ /= decay_;
+  if (scale_ < kMaxScale) return;
+
+  // Entries worth less than a cycle now are of threads and functions that
+  // stopped running long ago
+  double factor = 1 / scale_;
+  functions_.Rescale(factor, 1);
+  threads_.Rescale(factor, 1);
+  for (auto it = thread_functions_.begin(); it != thread_functions_.end();) {
+    it->second.Rescale(factor, 1);
+    if (it->second.order().empty()) {
+      it = thread_functions_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  scale_ = 1;
+}
+
+void LiveTop::Print(std::ostream &out, const SymbolNames &names,
+                    size_t threads, size_t functions,
+                    const std::string &unit) const {
+  out << std::fixed << std::setprecision(1);
+  out << refresh_weight_ << " " << unit << " since the last refresh"
+      << std::endl;
+  if (functions_.total() == 0) return;
+
+  auto print_functions = [&](const Table &table) {
+    size_t n = 0;
+    for (auto &entry : table.order()) {
+      if (n++ == functions) break;
+      out << "    " << std::setw(5) << 100 * entry.first / table.total()
+          << "%  " << names.Name(entry.second) << std::endl;
+    }
+  };
+
+  out << "  Overall:" << std::endl;
+  print_functions(functions_);
+  size_t n = 0;
+  for (auto &entry : threads_.order()) {
+    if (n++ == threads) break;
+    pid_t tid = static_cast<pid_t>(entry.second);
+    out << "  Thread " << tid << " (" << 100 * entry.first / threads_.total()
+        << "%):" << std::endl;
+    auto thread = thread_functions_.find(tid);
+    if (thread != thread_functions_.end()) print_functions(thread->second);
+  }
+  out.unsetf(std::ios::floatfield);
+  out << std::setprecision(6);
+}
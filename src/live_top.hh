@@ -0,0 +1,71 @@
+#ifndef LIVE_TOP_HH
+#define LIVE_TOP_HH
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <ostream>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "symbol_names.hh"
+
+// Cycles per function, of every thread and of the whole target, that decay at
+// every refresh of the live view, so the hottest functions are those of the
+// last few refreshes rather than of the whole run.
+// Decay scales every weight alike and so never changes the order of a table:
+// instead of shrinking old weights, new samples are added with a growing
+// scale. A sample only moves the entries it adds to.
+class LiveTop {
+ public:
+  // decay is the share of its weight a sample keeps at every refresh
+  explicit LiveTop(double decay) : decay_(decay) {}
+
+  // Add weight (cycles, or whatever the event counts) sampled in function key on thread tid
+  void Add(pid_t tid, uint32_t key, uint64_t weight);
+
+  // Age every weight by one refresh
+  void Decay();
+
+  // Print the hottest functions overall, and those of the hottest threads.
+  // Weights are counted in unit, like "cycles". Keys must be ids in names
+  void Print(std::ostream &out, const SymbolNames &names, size_t threads,
+             size_t functions, const std::string &unit) const;
+
+ private:
+  // Weights by id, also kept in descending order
+  class Table {
+   public:
+    using Order = std::set<std::pair<double, uint32_t>,
+                           std::greater<std::pair<double, uint32_t>>>;
+
+    void Add(uint32_t id, double weight);
+
+    // Multiply every weight by factor, and drop those left below min
+    void Rescale(double factor, double min);
+
+    double total() const { return total_; }
+    const Order &order() const { return order_; }
+
+   private:
+    std::unordered_map<uint32_t, double> weights_;
+    Order order_;
+    double total_ = 0;
+  };
+
+  // Once new samples are scaled up this much, every table is scaled down
+  // instead, before the weights overflow
+  static constexpr double kMaxScale = 1e30;
+
+  double decay_;
+  double scale_ = 1;  // what a cycle sampled now adds to the tables
+  uint64_t refresh_weight_ = 0;  // cycles sampled since the last refresh
+  Table functions_;
+  Table threads_;  // by tid
+  std::unordered_map<pid_t, Table> thread_functions_;
+};
+
+#endif  // LIVE_TOP_HH
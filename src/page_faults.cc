@@ -0,0 +1,189 @@
+#include "page_faults.hh"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "perf_lib.hh"
+
+namespace {
+// Return the counts as "key share%" pairs, largest first, leaving out those
+// past the first limit
+template <typename Key>
+std::string FormatShares(const std::map<Key, uint64_t> &counts, uint64_t total,
+                         size_t limit) {
+  std::vector<std::pair<uint64_t, Key>> sorted;
+  for (auto &c : counts) sorted.push_back({c.second, c.first});
+  std::sort(sorted.begin(), sorted.end(),
+            std::greater<std::pair<uint64_t, Key>>());
+  std::string shares;
+  for (size_t i = 0; i < sorted.size() && i < limit; i++) {
+    if (i != 0) shares += ", ";
+    shares += std::to_string(sorted[i].second) + " " +
+              std::to_string(100 * sorted[i].first / total) + "%";
+  }
+  if (sorted.size() > limit) shares += ", ...";
+  return shares;
+}
+
+// First touches of one mapping, or of one thread in a mapping
+struct Touches {
+  uint64_t pages = 0;
+  std::map<int, uint64_t> nodes;
+  std::map<std::pair<uint64_t, uint64_t>, uint64_t> sites;  // by ip, caller
+};
+}  // namespace
+
+void PageFaults::Add(pid_t pid, pid_t tid, uint64_t time, uint64_t addr,
+                     uint32_t cpu, bool major, uint64_t ip,
+                     const uint64_t *ips, uint64_t nr) {
+  Thread &thread = threads_[tid];
+  thread.pid = pid;
+  (major ? thread.major : thread.minor)++;
+  thread.cpus[cpu]++;
+
+  // The callchain starts with a context marker, and without the kernel's
+  // frames its first ip is the faulting one, even for faults in the kernel
+  uint64_t frames[2] = {ip, 0};
+  size_t found = 0;
+  for (uint64_t i = 0; i < nr && found < 2; i++) {
+    if (ips[i] < PERF_CONTEXT_MAX) frames[found++] = ips[i];
+  }
+
+  FirstTouch touch = {time, frames[0], frames[1], tid, cpu};
+  auto inserted = pages_[pid].insert({addr / PAGE_SIZE, touch});
+  if (!inserted.second && time < inserted.first->second.time) {
+    inserted.first->second = touch;
+  }
+}
+
+void PageFaults::Merge(const PageFaults &other) {
+  for (auto &t : other.threads_) {
+    Thread &thread = threads_[t.first];
+    thread.pid = t.second.pid;
+    thread.minor += t.second.minor;
+    thread.major += t.second.major;
+    for (auto &c : t.second.cpus) thread.cpus[c.first] += c.second;
+  }
+  for (auto &p : other.pages_) {
+    std::unordered_map<uint64_t, FirstTouch> &pages = pages_[p.first];
+    for (auto &page : p.second) {
+      auto inserted = pages.insert(page);
+      if (!inserted.second && page.second.time < inserted.first->second.time) {
+        inserted.first->second = page.second;
+      }
+    }
+  }
+}
+
+void PageFaults::Print(
+    std::ostream &out, const std::map<int, int> &cpu_nodes,
+    const std::function<std::string(pid_t, uint64_t)> &mapping_of,
+    const std::function<std::string(pid_t, uint64_t)> &function_of,
+    const std::unordered_map<pid_t, std::string> &thread_names) const {
+  auto node_of = [&](uint32_t cpu) {
+    auto it = cpu_nodes.find(cpu);
+    return it == cpu_nodes.end() ? 0 : it->second;
+  };
+
+  // Add up the first touches by mapping, and by thread within each
+  std::map<std::pair<pid_t, std::string>, Touches> mappings;
+  std::map<std::pair<pid_t, std::string>, std::map<pid_t, Touches>>
+      mapping_threads;
+  std::unordered_map<pid_t, uint64_t> thread_pages;
+  std::map<int, uint64_t> node_pages;
+  for (auto &p : pages_) {
+    for (auto &page : p.second) {
+      const FirstTouch &touch = page.second;
+      std::pair<pid_t, std::string> mapping = {
+          p.first, mapping_of(p.first, page.first * PAGE_SIZE)};
+      int node = node_of(touch.cpu);
+      Touches &all = mappings[mapping];
+      all.pages++;
+      all.nodes[node]++;
+      Touches &thread = mapping_threads[mapping][touch.tid];
+      thread.pages++;
+      thread.nodes[node]++;
+      thread.sites[{touch.ip, touch.caller}]++;
+      thread_pages[touch.tid]++;
+      node_pages[node]++;
+    }
+  }
+
+  out << "\nPage faults:" << std::endl;
+
+  // Threads with the most faults first
+  std::vector<std::pair<uint64_t, pid_t>> threads;
+  std::map<int, uint64_t> node_faults;
+  uint64_t total = 0;
+  for (auto &t : threads_) {
+    uint64_t faults = t.second.minor + t.second.major;
+    threads.push_back({faults, t.first});
+    for (auto &c : t.second.cpus) node_faults[node_of(c.first)] += c.second;
+    total += faults;
+  }
+  std::sort(threads.begin(), threads.end(),
+            std::greater<std::pair<uint64_t, pid_t>>());
+  for (auto &t : threads) {
+    const Thread &thread = threads_.at(t.second);
+    std::map<int, uint64_t> nodes;
+    for (auto &c : thread.cpus) nodes[node_of(c.first)] += c.second;
+    out << "  Thread " << t.second;
+    auto name = thread_names.find(t.second);
+    if (name != thread_names.end()) out << " (" << name->second << ")";
+    out << ": " << t.first << " faults, " << thread.major
+        << " major, first touch of " << thread_pages[t.second] << " pages"
+        << std::endl;
+    out << "    by node: " << FormatShares(nodes, t.first, nodes.size())
+        << std::endl;
+    out << "    by CPU: " << FormatShares(thread.cpus, t.first, 8) << std::endl;
+  }
+  for (auto &n : node_faults) {
+    out << "  Node " << n.first << ": " << n.second << " faults ("
+        << 100 * n.second / total << "%), first touch of "
+        << node_pages[n.first] << " pages" << std::endl;
+  }
+
+  // Mappings with the most first touches first, each with the threads that
+  // touched most of it, and the code they did it from
+  std::vector<std::pair<uint64_t, std::pair<pid_t, std::string>>> sorted;
+  for (auto &m : mappings) sorted.push_back({m.second.pages, m.first});
+  std::sort(sorted.begin(), sorted.end(),
+            [](const std::pair<uint64_t, std::pair<pid_t, std::string>> &a,
+               const std::pair<uint64_t, std::pair<pid_t, std::string>> &b) {
+              return a.first > b.first;
+            });
+  if (sorted.size() > kMaxMappings) sorted.resize(kMaxMappings);
+  out << "  First touches by mapping:" << std::endl;
+  for (auto &m : sorted) {
+    const Touches &all = mappings.at(m.second);
+    out << "    " << m.second.second << " (process " << m.second.first
+        << "): " << all.pages << " pages, by node "
+        << FormatShares(all.nodes, all.pages, all.nodes.size()) << std::endl;
+
+    std::vector<std::pair<uint64_t, pid_t>> touchers;
+    for (auto &t : mapping_threads.at(m.second)) {
+      touchers.push_back({t.second.pages, t.first});
+    }
+    std::sort(touchers.begin(), touchers.end(),
+              std::greater<std::pair<uint64_t, pid_t>>());
+    if (touchers.size() > kMaxThreads) touchers.resize(kMaxThreads);
+    for (auto &t : touchers) {
+      const Touches &thread = mapping_threads.at(m.second).at(t.second);
+      auto site = std::max_element(
+          thread.sites.begin(), thread.sites.end(),
+          [](const std::pair<const std::pair<uint64_t, uint64_t>, uint64_t> &a,
+             const std::pair<const std::pair<uint64_t, uint64_t>, uint64_t> &b) {
+            return a.second < b.second;
+          });
+      out << "      Thread " << t.second << ": " << thread.pages << " pages ("
+          << 100 * thread.pages / all.pages << "%), by node "
+          << FormatShares(thread.nodes, thread.pages, thread.nodes.size())
+          << ", mostly in " << function_of(m.second.first, site->first.first);
+      if (site->first.second != 0) {
+        out << " <- " << function_of(m.second.first, site->first.second);
+      }
+      out << std::endl;
+    }
+  }
+}
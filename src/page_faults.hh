@@ -0,0 +1,69 @@
+#ifndef PAGE_FAULTS_HH
+#define PAGE_FAULTS_HH
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+// Page faults by thread and CPU, and the fault that first touched every page,
+// to show where memory gets placed (--page-faults). Under the default NUMA
+// policy a page is allocated on the node of the CPU that first touches it, so
+// the first touches of a mapping tell which nodes it ended up on, and which
+// thread and code put it there. Every collector keeps its own, merged when
+// the run is over.
+class PageFaults {
+ public:
+  // Count a fault of thread tid of process pid at addr, taken on cpu at time.
+  // ips is the user callchain of the faulting code, innermost first; without
+  // one, ip is the faulting instruction.
+  void Add(pid_t pid, pid_t tid, uint64_t time, uint64_t addr, uint32_t cpu,
+           bool major, uint64_t ip, const uint64_t *ips, uint64_t nr);
+
+  // Add the faults of other. Of a page both have seen, the earlier touch is
+  // the first.
+  void Merge(const PageFaults &other);
+
+  bool empty() const { return threads_.empty(); }
+
+  // Print the faults of every thread by node and CPU, the faults of every
+  // node, and the first touches of the mappings with the most of them.
+  // cpu_nodes has the node of every CPU. mapping_of(pid, addr) names the
+  // mapping of process pid that addr is in, and function_of(pid, ip) the
+  // function ip is in.
+  void Print(std::ostream &out, const std::map<int, int> &cpu_nodes,
+             const std::function<std::string(pid_t, uint64_t)> &mapping_of,
+             const std::function<std::string(pid_t, uint64_t)> &function_of,
+             const std::unordered_map<pid_t, std::string> &thread_names) const;
+
+ private:
+  struct Thread {
+    pid_t pid = 0;
+    uint64_t minor = 0;
+    uint64_t major = 0;
+    std::map<uint32_t, uint64_t> cpus;  // faults by CPU
+  };
+
+  // The fault that reached a page first
+  struct FirstTouch {
+    uint64_t time;
+    uint64_t ip;      // innermost user frame of the faulting code
+    uint64_t caller;  // the frame that called it, or 0
+    pid_t tid;
+    uint32_t cpu;
+  };
+
+  // How many mappings, and threads of each, are shown
+  static constexpr size_t kMaxMappings = 10;
+  static constexpr size_t kMaxThreads = 5;
+
+  std::unordered_map<pid_t, Thread> threads_;  // by tid
+  std::unordered_map<pid_t, std::unordered_map<uint64_t, FirstTouch>>
+      pages_;  // by process, then page number
+};
+
+#endif  // PAGE_FAULTS_HH
@@ -1,8 +1,14 @@
 #include "perf_lib.hh"
 
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 
+#include <atomic>
+#include <string>
+
 #include "log.h"
 
 namespace {
@@ -10,27 +16,396 @@ long perf_event_open(struct perf_event_attr *hw_event, pid_t pid, int cpu,
                      int group_fd, unsigned long flags) {
   return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
 }
+
+// Hardware events counted next to the sampling event, COUNTER_INSTRUCTIONS
+// onwards
+const uint64_t kGroupCounters[] = {
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+static_assert(sizeof(kGroupCounters) / sizeof(kGroupCounters[0]) ==
+                  NUM_COUNTERS - 1,
+              "every counter but the leader needs an event");
+
+// Events that can be named in an event spec, by their perf names
+struct NamedEvent {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+const NamedEvent kNamedEvents[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"bus-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES},
+    {"stalled-cycles-frontend", PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+    {"stalled-cycles-backend", PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+    {"cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK},
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN},
+    {"major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    {"alignment-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_ALIGNMENT_FAULTS},
+    {"emulation-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_EMULATION_FAULTS},
+};
+
+// Tracefs is mounted on its own nowadays, and under debugfs before that
+const char *kTracingDirs[] = {"/sys/kernel/tracing",
+                              "/sys/kernel/debug/tracing"};
+
+// Fill in the event of config in pe. Tracepoints fire in the kernel, so
+// only their callchains can leave the kernel out.
+void SetEvent(const EventConfig &config, struct perf_event_attr *pe) {
+  pe->type = config.type;
+  pe->size = sizeof(struct perf_event_attr);
+  pe->config = config.config;
+  pe->exclude_kernel = config.type != PERF_TYPE_TRACEPOINT;
+  pe->exclude_callchain_kernel = 1;
+  pe->exclude_hv = 1;
+}
+
+// Return the CPUs of a list like "0-3,6,8-11"
+std::vector<int> ReadCpuList(FILE *list) {
+  std::vector<int> cpus;
+  int first;
+  while (fscanf(list, "%d", &first) == 1) {
+    int last = first;
+    int c = fgetc(list);
+    if (c == '-') {
+      REQUIRE(fscanf(list, "%d", &last) == 1) << "Malformed CPU list";
+      c = fgetc(list);
+    }
+    for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    if (c != ',') break;
+  }
+  return cpus;
+}
 }  // namespace
 
-void *PerfLib::GetNextRecord(int *type) {
+bool ParseEventSpec(const std::string &spec, EventConfig *config) {
+  for (const NamedEvent &event : kNamedEvents) {
+    if (spec == event.name) {
+      config->type = event.type;
+      config->config = event.config;
+      return true;
+    }
+  }
+
+  size_t colon = spec.find(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == spec.size()) {
+    return false;
+  }
+  std::string first = spec.substr(0, colon);
+  std::string second = spec.substr(colon + 1);
+
+  // A raw event is all numbers; the config may be in hex
+  if (first.find_first_not_of("0123456789") == std::string::npos) {
+    char *end;
+    unsigned long long raw_config = strtoull(second.c_str(), &end, 0);
+    if (*end != '\0') return false;
+    config->type = strtoul(first.c_str(), NULL, 10);
+    config->config = raw_config;
+    return true;
+  }
+
+  // Otherwise a tracepoint, with the id tracefs gave it
+  if (first.find('/') != std::string::npos ||
+      second.find('/') != std::string::npos || first[0] == '.' ||
+      second[0] == '.') {
+    return false;
+  }
+  for (const char *dir : kTracingDirs) {
+    std::string path =
+        std::string(dir) + "/events/" + first + "/" + second + "/id";
+    FILE *id_file = fopen(path.c_str(), "r");
+    if (id_file == NULL) continue;
+    unsigned long long id;
+    bool read = fscanf(id_file, "%llu", &id) == 1;
+    fclose(id_file);
+    if (!read) return false;
+    config->type = PERF_TYPE_TRACEPOINT;
+    config->config = id;
+    return true;
+  }
+  return false;
+}
+
+std::string EventName(const EventConfig &config) {
+  for (const NamedEvent &event : kNamedEvents) {
+    if (config.type == event.type && config.config == event.config) {
+      return event.name;
+    }
+  }
+  if (config.type == PERF_TYPE_TRACEPOINT) {
+    return "tracepoint " + std::to_string(config.config);
+  }
+  return std::to_string(config.type) + ":" + std::to_string(config.config);
+}
+
+const char *EventUnit(const EventConfig &config) {
+  if (config.type == PERF_TYPE_HARDWARE) {
+    switch (config.config) {
+      case PERF_COUNT_HW_CPU_CYCLES:
+      case PERF_COUNT_HW_REF_CPU_CYCLES:
+      case PERF_COUNT_HW_BUS_CYCLES:
+      case PERF_COUNT_HW_STALLED_CYCLES_FRONTEND:
+      case PERF_COUNT_HW_STALLED_CYCLES_BACKEND:
+        return "cycles";
+    }
+  } else if (config.type == PERF_TYPE_SOFTWARE &&
+             (config.config == PERF_COUNT_SW_CPU_CLOCK ||
+              config.config == PERF_COUNT_SW_TASK_CLOCK)) {
+    return "ns";
+  }
+  return "events";
+}
+
+bool EventAvailable(const EventConfig &config) {
+  // Open it disabled on ourselves, which needs no more privileges than
+  // opening it on a child
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(struct perf_event_attr));
+  SetEvent(config, &pe);
+  pe.sample_period = config.period;
+  pe.disabled = 1;
+  int fd = perf_event_open(&pe, /*pid=*/0, /*cpu=*/-1, /*group_fd=*/-1,
+                           /*flags=*/0);
+  if (fd == -1) return false;
+  close(fd);
+  return true;
+}
+
+uint64_t SampleType(const EventConfig &config) {
+  uint64_t sample_type = SAMPLE_TYPE;
+  if (config.time) sample_type |= PERF_SAMPLE_TIME;
+  if (config.counters) sample_type |= PERF_SAMPLE_READ;
+  if (config.callchain) sample_type |= PERF_SAMPLE_CALLCHAIN;
+  return sample_type;
+}
+
+void DecodeSample(uint64_t sample_type, const void *data, Sample *sample) {
+  // Fields come in the order of their PERF_SAMPLE_* bits
+  const uint64_t *pos = reinterpret_cast<const uint64_t *>(data);
+  if (sample_type & PERF_SAMPLE_IDENTIFIER) sample->id = *pos++;
+  if (sample_type & PERF_SAMPLE_IP) sample->ip = *pos++;
+  if (sample_type & PERF_SAMPLE_TID) {
+    const uint32_t *ids = reinterpret_cast<const uint32_t *>(pos++);
+    sample->pid = ids[0];
+    sample->tid = ids[1];
+  }
+  if (sample_type & PERF_SAMPLE_TIME) sample->time = *pos++;
+  if (sample_type & PERF_SAMPLE_ADDR) sample->addr = *pos++;
+  if (sample_type & PERF_SAMPLE_CPU) {
+    sample->cpu = reinterpret_cast<const uint32_t *>(pos++)[0];
+  }
+  if (sample_type & PERF_SAMPLE_PERIOD) sample->period = *pos++;
+  if (sample_type & PERF_SAMPLE_READ) {
+    // PERF_FORMAT_GROUP: the number of values, then the values
+    uint64_t nr = *pos++;
+    sample->counters = pos;
+    pos += nr;
+  }
+  if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+    sample->nr = *pos++;
+    sample->ips = pos;
+    pos += sample->nr;
+  }
+}
+
+uint64_t RecordTime(uint64_t sample_type, const perf_event_header *record) {
+  if (record->type == PERF_RECORD_SAMPLE) {
+    Sample sample;
+    DecodeSample(sample_type, record + 1, &sample);
+    return sample.time;
+  }
+
+  // The sample_id ends the record, with these 8-byte fields after its time
+  size_t after = 0;
+  for (uint64_t field : {PERF_SAMPLE_ID, PERF_SAMPLE_STREAM_ID,
+                         PERF_SAMPLE_CPU, PERF_SAMPLE_IDENTIFIER}) {
+    if (sample_type & field) after++;
+  }
+  const uint64_t *end = reinterpret_cast<const uint64_t *>(
+      reinterpret_cast<const char *>(record) + record->size);
+  return *(end - after - 1);
+}
+
+bool PerfLib::BeginBatch() {
+  // The acquire pairs with the kernel's write barrier, so every record before
+  // data_head is fully written before we read it
+  head_ = __atomic_load_n(&mmap_header_->data_head, __ATOMIC_ACQUIRE);
+  tail_ = mmap_header_->data_tail;
+  return head_ != tail_;
+}
+
+void *PerfLib::GetNextRecord(int *type, uint16_t *misc) {
+  if (tail_ == head_) return NULL;
+
+  // Records are 8-byte aligned, so a header never straddles the end of the
+  // buffer, but the rest of the record may
+  uint64_t offset = tail_ & (data_size_ - 1);
   perf_event_header *event_header = reinterpret_cast<perf_event_header *>(
-      reinterpret_cast<uintptr_t>(data_) +
-      mmap_header_->data_tail % mmap_header_->data_size);
+      reinterpret_cast<uintptr_t>(data_) + offset);
+
+  if (offset + event_header->size > data_size_) {
+    // Stitch the two halves together in a private copy
+    size_t first = data_size_ - offset;
+    wrapped_.resize(event_header->size);
+    memcpy(wrapped_.data(), event_header, first);
+    memcpy(wrapped_.data() + first, data_, event_header->size - first);
+    event_header = reinterpret_cast<perf_event_header *>(wrapped_.data());
+  }
 
   void *event_data = reinterpret_cast<void *>(
       reinterpret_cast<uintptr_t>(event_header) + sizeof(perf_event_header));
   *type = event_header->type;
+  if (misc != NULL) *misc = event_header->misc;
 
-  // Advance our tail pointer manually
-  // Kernel will update this for us
-  mmap_header_->data_tail += event_header->size;
+  tail_ += event_header->size;
   return event_data;
 }
 
-void PerfLib::SetupRingBuffer() {
+void PerfLib::EndBatch() {
+  // The release makes sure we are done reading the batch before the kernel
+  // may overwrite it
+  __atomic_store_n(&mmap_header_->data_tail, tail_, __ATOMIC_RELEASE);
+}
+
+int PerfLib::SwitchEventOpen(pid_t tid, const EventConfig &config) {
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(struct perf_event_attr));
+  pe.type = PERF_TYPE_SOFTWARE;
+  pe.size = sizeof(struct perf_event_attr);
+  pe.config = PERF_COUNT_SW_CONTEXT_SWITCHES;  // counted as a thread switches
+                                               // out, while it is current
+  pe.sample_period = 1;                 // sample every switch
+  pe.sample_type = SWITCH_SAMPLE_TYPE;  // where and when it blocked
+  pe.sample_id_all = 1;    // time-stamp the switch records too
+  pe.context_switch = 1;   // record every switch in and out
+  pe.disabled = 1;
+  pe.exclude_callchain_kernel = 1;  // only the user callchain is wanted
+  pe.exclude_hv = 1;
+  pe.watermark = 1;  // switch records are not samples, so always by bytes
+  pe.wakeup_watermark = config.wakeup_bytes;
+
+  // The event fires inside the scheduler, so it only samples if the kernel
+  // is not excluded. Where that is not permitted, the switch records still
+  // give the off-CPU time, without blocking sites.
+  static std::atomic<bool> kernel_allowed(true);
+  fd_ = -1;
+  if (kernel_allowed) {
+    fd_ = perf_event_open(&pe, tid, /*cpu=*/-1, /*group_fd=*/-1, /*flags=*/0);
+    if (fd_ == -1 && (errno == EACCES || errno == EPERM)) {
+      WARNING << "Blocking sites need perf_event_paranoid <= 1; reporting "
+              << "off-CPU time only";
+      kernel_allowed = false;
+    }
+  }
+  if (!kernel_allowed) {
+    pe.exclude_kernel = 1;
+    fd_ = perf_event_open(&pe, tid, /*cpu=*/-1, /*group_fd=*/-1, /*flags=*/0);
+  }
+  if (fd_ == -1 && errno == ESRCH) {
+    return -1;
+  } else {
+    REQUIRE(fd_ != -1) << "perf_event_open failed for the context-switch "
+                       << "event: " << strerror(errno);
+  }
+  tid_ = tid;
+  cpu_ = -1;
+  switch_event_ = true;
+  fault_event_ = false;
+  counter_fds_.clear();
+  SetupRingBuffer(config.data_pages);
+  return fd_;
+}
+
+int PerfLib::FaultEventOpen(pid_t tid, const EventConfig &config) {
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(struct perf_event_attr));
+  pe.type = PERF_TYPE_SOFTWARE;
+  pe.size = sizeof(struct perf_event_attr);
+  pe.config = PERF_COUNT_SW_PAGE_FAULTS_MIN;  // the major faults are a
+                                              // second event, below
+  pe.sample_period = 1;                // sample every fault
+  pe.sample_type = FAULT_SAMPLE_TYPE;  // where, by whom and on which CPU
+  pe.sample_id_all = 1;  // time-stamp the mmap records too
+  pe.mmap_data = 1;  // report the mappings faults land in; without mmap or
+                     // mmap2, these are data mappings only, as MMAP records
+  pe.disabled = 1;
+  pe.exclude_callchain_kernel = 1;  // only the user callchain is wanted
+  pe.exclude_hv = 1;
+  pe.watermark = 1;  // mmap records are not samples, so always by bytes
+  pe.wakeup_watermark = config.wakeup_bytes;
+
+  // Faults in system calls (such as a read into a fresh buffer) are taken in
+  // the kernel, so they are only seen if the kernel is not excluded
+  static std::atomic<bool> kernel_allowed(true);
+  fd_ = -1;
+  if (kernel_allowed) {
+    fd_ = perf_event_open(&pe, tid, /*cpu=*/-1, /*group_fd=*/-1, /*flags=*/0);
+    if (fd_ == -1 && (errno == EACCES || errno == EPERM)) {
+      WARNING << "Page faults in system calls need perf_event_paranoid <= 1; "
+              << "reporting faults in user code only";
+      kernel_allowed = false;
+    }
+  }
+  if (!kernel_allowed) {
+    pe.exclude_kernel = 1;
+    fd_ = perf_event_open(&pe, tid, /*cpu=*/-1, /*group_fd=*/-1, /*flags=*/0);
+  }
+  if (fd_ == -1 && errno == ESRCH) return -1;
+  REQUIRE(fd_ != -1) << "perf_event_open failed for the page-fault event: "
+                     << strerror(errno);
+
+  // Major faults go into the same buffer, told apart by their id. As a
+  // member of the group, the event starts and stops with the first one.
+  SetupRingBuffer(config.data_pages);
+  pe.config = PERF_COUNT_SW_PAGE_FAULTS_MAJ;
+  pe.mmap_data = 0;
+  pe.disabled = 0;
+  int major_fd = perf_event_open(&pe, tid, /*cpu=*/-1, /*group_fd=*/fd_,
+                                 /*flags=*/0);
+  if (major_fd == -1 && errno == ESRCH) {
+    counter_fds_.clear();
+    Close();
+    return -1;
+  }
+  REQUIRE(major_fd != -1) << "perf_event_open failed for the major-fault "
+                          << "event: " << strerror(errno);
+  REQUIRE(ioctl(major_fd, PERF_EVENT_IOC_SET_OUTPUT, fd_) != -1)
+      << "Failed to redirect perf event: " << strerror(errno);
+  REQUIRE(ioctl(major_fd, PERF_EVENT_IOC_ID, &major_fault_id_) != -1)
+      << "Failed to read the perf event id: " << strerror(errno);
+
+  tid_ = tid;
+  cpu_ = -1;
+  switch_event_ = false;
+  fault_event_ = true;
+  counter_fds_.assign(1, major_fd);
+  return fd_;
+}
+
+void PerfLib::Close() {
+  if (mmap_header_ != NULL) munmap(mmap_header_, PAGE_SIZE + data_size_);
+  for (int counter_fd : counter_fds_) close(counter_fd);
+  close(fd_);
+}
+
+void PerfLib::SetupRingBuffer(size_t data_pages) {
   // the mmap size has to be 1 + 2^n pages, where the first page is a metadata
   // page
-  uint64_t buffer_size = (1 + NUM_DATA_PAGES) * PAGE_SIZE;
+  data_size_ = data_pages * PAGE_SIZE;
+  uint64_t buffer_size = PAGE_SIZE + data_size_;
   void *buffer =
       mmap(/*addr=*/NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_,
            /*offset=*/0);
@@ -39,39 +414,139 @@ void PerfLib::SetupRingBuffer() {
   mmap_header_ = reinterpret_cast<perf_event_mmap_page *>(buffer);
   data_ = reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(mmap_header_) +
                                    PAGE_SIZE);
+  head_ = tail_ = mmap_header_->data_tail;
+}
+
+std::vector<int> OnlineCpus() {
+  FILE *online = fopen("/sys/devices/system/cpu/online", "r");
+  REQUIRE(online != NULL) << "Failed to open the online CPU list: "
+                          << strerror(errno);
+  std::vector<int> cpus = ReadCpuList(online);
+  fclose(online);
+  return cpus;
 }
 
-int PerfLib::PerfEventOpen(pid_t child_pid) {
-  struct perf_event_attr pe = {
-      .type = PERF_TYPE_HARDWARE,  // Count occurrences of a hardware event
-      .size = sizeof(struct perf_event_attr),
-      .config = PERF_COUNT_HW_REF_CPU_CYCLES,  // Count cycles on the CPU
-                                               // independent of frequency
-                                               // scaling
-      .sample_period = SAMPLE_PERIOD,          // period of sampling
-      .sample_type = SAMPLE_TYPE,              // types of sample we collect
-      .disabled = 1,        // Start the counter in a disabled state
-      .inherit = 0,         // Processes or threads created in the child should
-                            // also be profiled
-      .task = 1,            // enable fork/exit record
-      .exclude_kernel = 1,  // Do not take samples in the kernel
-      .exclude_callchain_kernel = 1,
-      .exclude_hv = 1,  // Do not take samples in the hypervisor
-      .watermark = 1,   // set up to actually receive overflow notification
-      .wakeup_watermark =
-          1,  // receive overflow notification for all PERF_RECORD types
-  };
-
-  fd_ = perf_event_open(&pe, child_pid, /*cpu=*/-1, /*group_fd=*/-1,
+std::map<int, int> CpuNodes() {
+  std::map<int, int> nodes;
+  for (int cpu : OnlineCpus()) nodes[cpu] = 0;
+
+  DIR *node_dir = opendir("/sys/devices/system/node");
+  if (node_dir == NULL) return nodes;
+  dirent *entry;
+  while ((entry = readdir(node_dir)) != NULL) {
+    int node;
+    if (sscanf(entry->d_name, "node%d", &node) != 1) continue;
+    std::string path = std::string("/sys/devices/system/node/") +
+                       entry->d_name + "/cpulist";
+    FILE *cpulist = fopen(path.c_str(), "r");
+    if (cpulist == NULL) continue;
+    for (int cpu : ReadCpuList(cpulist)) nodes[cpu] = node;
+    fclose(cpulist);
+  }
+  closedir(node_dir);
+  return nodes;
+}
+
+int PerfLib::PerfEventOpen(pid_t child_pid, int cpu, const EventConfig &config,
+                           const PerfLib *output) {
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(struct perf_event_attr));
+  SetEvent(config, &pe);  // Count occurrences of the event of -e, by
+                          // default cycles independent of frequency scaling
+  if (config.frequency != 0) {
+    pe.freq = 1;                             // the kernel adjusts the period
+    pe.sample_freq = config.frequency;       // to get this many samples/s
+  } else {
+    pe.sample_period = config.period;        // period of sampling
+  }
+  pe.sample_type = SampleType(config);       // types of sample we collect
+  pe.sample_id_all = config.time;  // and time-stamp the other records too
+  if (config.counters) {
+    pe.read_format = PERF_FORMAT_GROUP;  // samples read the whole group
+  }
+  pe.disabled = 1;        // Start the counter in a disabled state
+  pe.inherit = config.inherit;  // Processes or threads created in the
+                                // child should also be profiled
+  pe.task = 1;            // enable fork/exit record
+  pe.mmap = 1;            // enable records for executable mappings. The
+                          // kernel matches them to mmap or mmap2, but only
+                          // counts an event as wanting mmap records (and
+                          // skips making any while none does) for mmap or
+                          // mmap_data, so mmap2 alone may get none.
+  pe.mmap2 = 1;           // report them in the MMAP2 format
+  pe.comm = 1;            // enable comm records, so we can see exec
+  pe.comm_exec = 1;       // flag comm records that come from exec
+  if (config.wakeup_events != 0) {
+    pe.wakeup_events = config.wakeup_events;  // notify every this many
+                                              // samples; other records wait
+  } else {
+    pe.watermark = 1;  // notify once this many bytes of any PERF_RECORD
+                       // types are waiting
+    pe.wakeup_watermark = config.wakeup_bytes;
+  }
+
+  fd_ = perf_event_open(&pe, child_pid, cpu, /*group_fd=*/-1,
                         /*flags=*/0);
 
   // We may have missed a thread entirely
   if (fd_ == -1 && errno == ESRCH) {
     return -1;
   } else {
-    REQUIRE(fd_ != -1) << "perf_event_open failed: " << strerror(errno);
+    REQUIRE(fd_ != -1) << "perf_event_open failed for " << EventName(config)
+                       << ": " << strerror(errno);
+  }
+  tid_ = child_pid;
+  cpu_ = cpu;
+  switch_event_ = false;
+  fault_event_ = false;
+
+  // The rest of the group only counts. It is enabled and disabled along with
+  // the leader, and its values are read into the leader's samples.
+  counter_fds_.clear();
+  if (config.counters) {
+    for (uint64_t counter : kGroupCounters) {
+      struct perf_event_attr ce;
+      memset(&ce, 0, sizeof(struct perf_event_attr));
+      ce.type = PERF_TYPE_HARDWARE;
+      ce.size = sizeof(struct perf_event_attr);
+      ce.config = counter;
+      ce.exclude_kernel = 1;
+      ce.exclude_hv = 1;
+      int counter_fd = perf_event_open(&ce, child_pid, cpu, /*group_fd=*/fd_,
+                                       /*flags=*/0);
+      if (counter_fd == -1 && errno == ESRCH) {
+        for (int fd : counter_fds_) close(fd);
+        close(fd_);
+        return -1;
+      }
+      REQUIRE(counter_fd != -1)
+          << "perf_event_open failed for a group counter: " << strerror(errno);
+      counter_fds_.push_back(counter_fd);
+    }
+  }
+
+  if (output == NULL) {
+    SetupRingBuffer(config.data_pages);
+  } else {
+    REQUIRE(ioctl(fd_, PERF_EVENT_IOC_SET_OUTPUT, output->fd_) != -1)
+        << "Failed to redirect perf event: " << strerror(errno);
+    mmap_header_ = NULL;
   }
-  SetupRingBuffer();
   return fd_;
 }
 
+
+std::vector<pid_t> ProcessThreads(pid_t pid) {
+  std::string path = "/proc/" + std::to_string(pid) + "/task";
+  std::vector<pid_t> tids;
+  DIR *tasks = opendir(path.c_str());
+  if (tasks == NULL) return tids;
+
+  dirent *entry;
+  while ((entry = readdir(tasks)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    tids.push_back(strtol(entry->d_name, NULL, 10));
+  }
+  closedir(tasks);
+  return tids;
+}
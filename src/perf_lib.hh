@@ -8,17 +8,59 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <map>
+#include <string>
+#include <vector>
+
 #include "log.h"
 
-// Memory mapping for PERF_SAMPLE_RECORD
-struct SampleRecord {
+// Counters read with every sample (EventConfig::counters only), in the order
+// of the group. The sampling event leads the group.
+enum Counter {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_BRANCH_MISSES,
+  NUM_COUNTERS,
+};
+
+// Values of every counter in the group
+struct CounterValues {
+  uint64_t value[NUM_COUNTERS] = {};
+
+  void Add(const CounterValues &other) {
+    for (int i = 0; i < NUM_COUNTERS; i++) value[i] += other.value[i];
+  }
+};
+
+// The fields of a PERF_RECORD_SAMPLE. Which fields the kernel writes, and so
+// where each one is, depends on the sample_type of the event.
+struct Sample {
+  uint64_t id;    // id of the event that took the sample
+                  // (PERF_SAMPLE_IDENTIFIER only)
   uint64_t ip;    // instruction pointer
   uint32_t pid;   // process id
   uint32_t tid;   // thread id
-  uint64_t nr;    // number of functions in challchains
-  uint64_t *ips;  // array of instruction pointers in callchains
+  uint64_t time;  // timestamp in nanoseconds (PERF_SAMPLE_TIME only)
+  uint64_t addr;  // faulting data address (PERF_SAMPLE_ADDR only)
+  uint32_t cpu;   // cpu the sample was taken on
+  uint64_t period;  // cycles since the previous sample, i.e. its weight
+  const uint64_t *counters = NULL;  // running value of every counter in the
+                                    // group (PERF_SAMPLE_READ only)
+  uint64_t nr = 0;                  // number of functions in callchains
+  const uint64_t *ips = NULL;       // instruction pointers in callchains,
+                                    // innermost first (only present with
+                                    // PERF_SAMPLE_CALLCHAIN)
 };
 
+// Decode the body of a sample record of an event with the given sample_type
+void DecodeSample(uint64_t sample_type, const void *data, Sample *sample);
+
+// Return the timestamp of a record of an event with the given sample_type,
+// which must have PERF_SAMPLE_TIME and sample_id_all set: a sample's own, or
+// that of the sample_id the kernel appends to any other record
+uint64_t RecordTime(uint64_t sample_type, const perf_event_header *record);
+
 // Memory mapping for PERF_FORK_RECORD and PERF_EXIT_RECORD
 struct TaskRecord {
   uint32_t pid;
@@ -28,20 +70,172 @@ struct TaskRecord {
   uint64_t time;
 };
 
+// Memory mapping for PERF_RECORD_MMAP, which only the page-fault event asks
+// for, and only for data mappings
+struct MmapRecord {
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t addr;    // start address of the mapping
+  uint64_t len;     // length of the mapping
+  uint64_t pgoff;   // file offset mapped at addr
+  char filename[];  // null-terminated path of the mapped file, or a name
+                    // such as //anon or [heap]
+};
+
+// Memory mapping for PERF_RECORD_MMAP2
+struct Mmap2Record {
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t addr;   // start address of the mapping
+  uint64_t len;    // length of the mapping
+  uint64_t pgoff;  // file offset mapped at addr
+  uint32_t maj;
+  uint32_t min;
+  uint64_t ino;
+  uint64_t ino_generation;
+  uint32_t prot;
+  uint32_t flags;
+  char filename[];  // null-terminated path of the mapped file
+};
+
+// Memory mapping for PERF_RECORD_COMM
+struct CommRecord {
+  uint32_t pid;
+  uint32_t tid;
+  char comm[];  // null-terminated new name of the thread
+};
+
+// Memory mapping for PERF_RECORD_SWITCH of the context-switch event, which
+// is nothing but the sample_id of the event (see SWITCH_SAMPLE_TYPE)
+struct SwitchRecord {
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t time;
+};
+
+// Memory mapping for PERF_RECORD_LOST
+struct LostRecord {
+  uint64_t id;    // id of the event that lost the records
+  uint64_t lost;  // number of records lost
+};
+
 // constants for attributes
-constexpr auto SAMPLE_PERIOD = 10000000;
+constexpr auto SAMPLE_PERIOD = 10000000;  // default, see EventConfig
 constexpr auto SAMPLE_TYPE =
-    PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
-constexpr auto NUM_DATA_PAGES = 256;
+    PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD;
+constexpr auto NUM_DATA_PAGES = 256;  // default, see EventConfig
+
+// Samples of the context-switch event (PerfLib::SwitchEventOpen) are laid out
+// by SWITCH_SAMPLE_TYPE rather than by the EventConfig, so they are handed on
+// with a record type of their own
+constexpr auto SWITCH_SAMPLE_TYPE = PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+                                    PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN;
+constexpr int RECORD_SWITCH_SAMPLE = 0x10001;
+
+// Samples of the page-fault events (PerfLib::FaultEventOpen), likewise, with
+// a record type for each of minor and major faults
+constexpr auto FAULT_SAMPLE_TYPE =
+    PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+    PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR | PERF_SAMPLE_CPU |
+    PERF_SAMPLE_CALLCHAIN;
+constexpr int RECORD_MINOR_FAULT_SAMPLE = 0x10002;
+constexpr int RECORD_MAJOR_FAULT_SAMPLE = 0x10003;
 constexpr auto PAGE_SIZE = 0x1000LL;
 
+// Settings shared by every event the profiler opens
+struct EventConfig {
+  uint32_t type = PERF_TYPE_HARDWARE;  // event sampled, as perf_event_attr
+  uint64_t config = PERF_COUNT_HW_REF_CPU_CYCLES;  // names it (see -e)
+  size_t data_pages = NUM_DATA_PAGES;  // ring buffer size, a power of two
+  uint64_t period = SAMPLE_PERIOD;     // events between samples: cycles, or
+                                       // ns for the clocks
+  uint64_t frequency = 0;  // if not 0, take this many samples per second
+                           // instead, letting the kernel adjust the period
+  bool inherit = false;  // threads created later are sampled by the same event
+  bool callchain = false;  // add PERF_SAMPLE_CALLCHAIN to every sample
+  bool counters = false;   // read the whole Counter group with every sample
+  bool time = false;       // add PERF_SAMPLE_TIME to every sample, and a
+                           // timestamp to every other record
+  size_t wakeup_bytes = 1;     // wake the reader once this many bytes of
+                               // records are waiting
+  uint32_t wakeup_events = 0;  // if not 0, wake it every this many samples
+                               // instead
+};
+
+// Return the sample_type of the events opened with config
+uint64_t SampleType(const EventConfig &config);
+
+// Set the type and config of config to the event named by spec: a hardware
+// or software event by its perf name (cycles, instructions, task-clock, ...),
+// "<type>:<config>" in numbers for any other event the kernel knows, or
+// "<subsystem>:<name>" for a tracepoint, whose id is read from tracefs.
+// Return false if spec names no event
+bool ParseEventSpec(const std::string &spec, EventConfig *config);
+
+// Return the perf name of the event of config, or its type and config
+std::string EventName(const EventConfig &config);
+
+// Return what the event of config counts: "cycles", "ns" for the clocks,
+// whose counts are times, or "events"
+const char *EventUnit(const EventConfig &config);
+
+// Return true if the event of config can be opened. Hardware events cannot
+// on machines without a usable PMU, as in many VMs and containers.
+bool EventAvailable(const EventConfig &config);
+
+// Return the ids of all online CPUs
+std::vector<int> OnlineCpus();
+
+// Return the NUMA node of every online CPU; all are on node 0 if the system
+// has no NUMA information
+std::map<int, int> CpuNodes();
+
+// Return the ids of all threads of process pid, or nothing if it has gone away
+std::vector<pid_t> ProcessThreads(pid_t pid);
+
 // A wrapper library around perf_event_open to sample and get records
 class PerfLib {
  public:
-  int PerfEventOpen(pid_t child_pid);
+  // Open a sampling event on child_pid, on every CPU (cpu = -1) or only on
+  // one. With config.inherit, threads created by child_pid later are sampled
+  // by the same event, into the same buffer.
+  // If output is not NULL, records go to output's ring buffer instead of one
+  // of our own; output must be open on the same cpu.
+  // Return -1 if the thread has already gone away
+  int PerfEventOpen(pid_t child_pid, int cpu, const EventConfig &config,
+                    const PerfLib *output = NULL);
+
+  // Open an event on thread tid that takes a sample with the user callchain
+  // every time the thread is switched out, and writes a PERF_RECORD_SWITCH
+  // every time it is switched back in
+  // Return -1 if the thread has already gone away
+  int SwitchEventOpen(pid_t tid, const EventConfig &config);
+
+  // Open events on thread tid that take a sample with the faulting address
+  // and the user callchain at every minor and every major page fault, both
+  // into one buffer, which also gets PERF_RECORD_MMAP records for every data
+  // mapping the thread creates. Samples of major faults carry the id
+  // major_fault_id().
+  // Return -1 if the thread has already gone away
+  int FaultEventOpen(pid_t tid, const EventConfig &config);
 
-  // Return next record and store the type of the record in type
-  void *GetNextRecord(int *type);
+  // Unmap the ring buffer (if the event has its own) and close the event
+  // (and its group)
+  void Close();
+
+  // Records are read in batches. BeginBatch snapshots how far the kernel has
+  // written; GetNextRecord then walks the records up to that point, and
+  // EndBatch hands all of their space back to the kernel at once.
+  // Return false if there is nothing new to read
+  bool BeginBatch();
+
+  // Return next record of the batch and store the type of the record in type,
+  // or return NULL at the end of the batch
+  // If misc is not NULL, also store the misc bits of the record header in it
+  // The record stays valid until the next call
+  void *GetNextRecord(int *type, uint16_t *misc = NULL);
+
+  void EndBatch();
 
   // stop, resume, or reset sampling
   void StartSampling() {
@@ -64,16 +258,38 @@ class PerfLib {
 
   // Decide if next record exists or not
   bool HasNextRecord() {
-    return mmap_header_->data_head != mmap_header_->data_tail;
+    return __atomic_load_n(&mmap_header_->data_head, __ATOMIC_ACQUIRE) !=
+           mmap_header_->data_tail;
   }
 
+  int fd() const { return fd_; }
+  pid_t tid() const { return tid_; }
+  int cpu() const { return cpu_; }
+  bool switch_event() const { return switch_event_; }
+  bool fault_event() const { return fault_event_; }
+  uint64_t major_fault_id() const { return major_fault_id_; }
+
+  // Bytes of the current batch not read yet, out of the whole ring buffer
+  uint64_t batch_remaining() const { return head_ - tail_; }
+  uint64_t data_size() const { return data_size_; }
+
  private:
   // Setup the mmap ring buffer
-  void SetupRingBuffer();
+  void SetupRingBuffer(size_t data_pages);
 
   int fd_;                             // fd associated with this perf call
+  pid_t tid_;                          // thread the event was opened on
+  int cpu_;                            // cpu the event was opened on, or -1
+  bool switch_event_;                  // opened by SwitchEventOpen
+  bool fault_event_;                   // opened by FaultEventOpen
+  uint64_t major_fault_id_;            // id of its major-fault event
   perf_event_mmap_page *mmap_header_;  // header section for mmap region
   void *data_;                         // data section for mmap region
+  uint64_t data_size_;                 // size of the data section in bytes
+  uint64_t head_;                      // end of the current batch
+  uint64_t tail_;                      // next record of the current batch
+  std::vector<char> wrapped_;          // copy of a record that wrapped around
+  std::vector<int> counter_fds_;       // the rest of the Counter group
 };
 
 #endif  // PERF_LIB_HH
@@ -3,237 +3,2390 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <algorithm>
+#include <atomic>
+#include <fstream>
 #include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "address_space.hh"
+#include "calling_context_tree.hh"
+#include "diff.hh"
+#include "flamegraph.hh"
 #include "inspect.h"
+#include "ip_histogram.hh"
+#include "live_top.hh"
+#include "page_faults.hh"
 #include "log.h"
 #include "perf_lib.hh"
+#include "recording.hh"
+#include "self_stats.hh"
+#include "symbol_names.hh"
+#include "timeline.hh"
 
-#define MAX_EPOLL_EVENTS 10
+#define MAX_EPOLL_EVENTS 64
 
-// Type alias for a mapping from function name to number of times occured
+// The live view (--top) shows this many threads and functions per table, and
+// samples keep this share of their weight at every refresh
+#define TOP_THREADS 8
+#define TOP_FUNCTIONS 10
+#define TOP_DECAY 0.5
+
+// With --wakeup tick or adaptive, buffers wake their collector by themselves
+// only once they are this full, and are otherwise drained on a tick. The
+// adaptive tick halves when a buffer was more than half full at a drain, and
+// doubles when none was more than an eighth full. With --wakeup bytes or
+// events, a slow tick still drains records that fill no buffer, such as the
+// forks of an idle thread.
+#define WAKEUP_SAFETY_FILL 0.75
+#define WAKEUP_TICK_MS 10
+#define WAKEUP_FLUSH_MS 100
+#define ADAPTIVE_MIN_TICK_MS 1
+#define ADAPTIVE_MAX_TICK_MS 100
+#define ADAPTIVE_HIGH_FILL 0.5
+#define ADAPTIVE_LOW_FILL 0.125
+
+// Type alias for a mapping from function name to number of cycles sampled in
+// it
 using function_freq_t = std::unordered_map<std::string, size_t>;
 
 // Mapping from thread id to function frequency table
 std::unordered_map<pid_t, function_freq_t> thread_mapping;
 
-// Mapping from thread id to the total number of samples collected in this
-// thread
+// Mapping from thread id to the total number of cycles sampled in this thread
 std::unordered_map<pid_t, size_t> thread_sample_count;
 
+// Mapping from thread id to its name, as far as COMM records tell, and to
+// the process it belongs to
+// Guarded by thread_names_lock, since any shard may read a FORK or COMM record
+std::unordered_map<pid_t, std::string> thread_names;
+std::unordered_map<pid_t, pid_t> thread_processes;
+std::mutex thread_names_lock;
+
+// Threads of the target, in any of its processes, that have not exited yet.
+// Profiling goes on until the last one has. A thread's exit may be read from
+// its own buffer before its creation from its parent's; such threads wait in
+// exited_threads for their FORK record.
+// Guarded by live_threads_lock
+std::unordered_set<pid_t> live_threads;
+std::unordered_set<pid_t> exited_threads;
+std::mutex live_threads_lock;
+
+// Raw instruction pointers sampled in one thread under one generation of the
+// code mappings, symbolized after the target exits when running with
+// --deferred
+struct ThreadIps {
+  pid_t pid;                  // process the thread belongs to
+  pid_t tid;
+  uint32_t generation;        // see mapping_generation
+  IpHistogram ips;            // sample count per raw ip
+  CallingContextTree stacks;  // call paths by raw ip (--call-graph only)
+  std::unordered_map<uint64_t, CounterValues> counters;  // by raw ip
+                                                         // (--counters only)
+};
+
+// Return the key of the raw samples of thread tid under generation
+inline uint64_t ThreadIpsKey(pid_t tid, uint32_t generation) {
+  return static_cast<uint64_t>(generation) << 32 | static_cast<uint32_t>(tid);
+}
+
+// Mapping from ThreadIpsKey to the raw samples, merged from all shards
+// (--deferred only)
+std::unordered_map<uint64_t, ThreadIps> thread_ips;
+
+// Time one thread spent on and off the CPU, measured from its context
+// switches (--off-cpu only)
+struct OffCpuThread {
+  pid_t pid = 0;
+  uint64_t on_cpu = 0;     // nanoseconds running
+  uint64_t blocked = 0;    // nanoseconds off the CPU after blocking
+  uint64_t preempted = 0;  // nanoseconds waiting for a CPU after preemption
+  CallingContextTree sites;  // blocked time by user call path at switch-out,
+                             // in raw ips
+
+  // State of the switch in progress
+  uint64_t last_in = 0;   // time of the last switch in, if running
+  uint64_t last_out = 0;  // time of the last switch out, if not running
+  bool was_preempted = false;
+  std::vector<uint64_t> out_stack;  // user callchain at the last switch out
+};
+
+// Mapping from thread id to its on- and off-CPU time, merged from all shards
+// (--off-cpu only)
+std::unordered_map<pid_t, OffCpuThread> off_cpu_threads;
+
+// Mapping from thread id to the counters of each function, by function name
+// (--counters only)
+std::unordered_map<pid_t, std::unordered_map<std::string, CounterValues>>
+    thread_counters;
+
+// Names of all functions seen, so call paths can refer to them by id
+SymbolNames symbol_names;
+
+// Mapping from thread id to its call paths by symbol id (--call-graph only)
+std::unordered_map<pid_t, CallingContextTree> thread_cct;
+
+// Mapping from process id to the symbol id of every ip resolved in it, so
+// each distinct ip in a callchain is only looked up once
+std::unordered_map<pid_t, std::unordered_map<uint64_t, uint32_t>> ip_symbols;
+
+// A sample kept with its time for the timeline (--timeline only)
+struct TimedSample {
+  uint64_t time;    // perf timestamp in nanoseconds
+  uint64_t ip;      // raw instruction pointer
+  uint64_t weight;  // cycles since the thread's previous sample
+  pid_t pid;
+  pid_t tid;
+};
+
+// One collector thread. It owns an epoll instance with a subset of the perf
+// fds, and only ever writes its own raw sample tables, so collecting needs no
+// locks. The tables of all shards are merged once the target has exited.
+struct Shard {
+  int epoll_fd;
+  std::unordered_map<uint64_t, ThreadIps> thread_ips;  // by ThreadIpsKey
+
+  // Consecutive samples usually come from the same thread (one ring buffer
+  // per thread), so the last table used is remembered. Elements of an
+  // unordered_map never move, so the pointer stays valid.
+  uint64_t last_key = UINT64_MAX;
+  ThreadIps *last_ips = NULL;
+
+  // Number of records the kernel dropped, by thread in per-thread mode and
+  // by CPU in per-CPU mode
+  std::unordered_map<pid_t, uint64_t> thread_lost;
+  std::map<int, uint64_t> cpu_lost;
+
+  // Counter values of the last sample of every thread, so each sample can be
+  // charged what was counted since the one before (--counters only)
+  std::unordered_map<pid_t, CounterValues> last_counters;
+
+  // Samples in the order they were read, and when threads were created and
+  // exited (--timeline only)
+  std::vector<TimedSample> timed_samples;
+  std::unordered_map<pid_t, uint64_t> thread_starts;
+  std::unordered_map<pid_t, uint64_t> thread_ends;
+
+  // Cycles by raw ip in every process (--annotate only)
+  std::unordered_map<pid_t, IpHistogram> process_ips;
+
+  // Page faults of the threads in this shard (--page-faults only)
+  PageFaults page_faults;
+
+  // Context switches of the threads in this shard, which always has a
+  // thread's context-switch event as well as its main one (--off-cpu only)
+  std::unordered_map<pid_t, OffCpuThread> off_cpu;
+
+  // Records waiting to be written to the recording, and the time of the last
+  // one read from a buffer, which records made up after it also get
+  // (--record only)
+  RecordBuffer record_buffer;
+  uint64_t record_time = 0;
+
+  // What collecting costs this shard (--self-stats only)
+  SelfStats stats;
+
+  // Perf fds whose buffers this shard reads. Guarded by perf_libs_lock, but
+  // only ever removed by the shard itself.
+  std::unordered_set<int> perf_fds;
+
+  // Timer that drains all of them, its period, and the fullest a buffer was
+  // since it last fired (--wakeup other than record only)
+  int tick_fd = -1;
+  uint64_t tick_ns = 0;
+  double max_fill = 0;
+};
+
+// All collector threads; shard 0 runs on the main thread
+std::vector<Shard> shards;
+
+// Shard that receives the next new thread
+std::atomic<size_t> next_shard(0);
+
 // Mapping from perf fd to PerfLib
+// Guarded by perf_libs_lock, since a FORK record read by one shard opens a
+// PerfLib that is read by another
 std::unordered_map<int, PerfLib> perf_libs;
+std::mutex perf_libs_lock;
+
+// Mapping from process id to its executable mappings
+// Updates are guarded by address_spaces_lock. With more than one shard,
+// samples are never symbolized until all collectors have stopped.
+std::unordered_map<pid_t, AddressSpace> address_spaces;
+std::mutex address_spaces_lock;
+
+// Generation of the code mappings of all processes. It advances whenever a
+// mapping drops or replaces code (exec, or dlclose and a dlopen at the same
+// addresses), and deferred samples are kept apart by it, so each is resolved
+// against the mappings it was taken under (--deferred only).
+std::atomic<uint32_t> mapping_generation(0);
+
+// Mapping from process id to copies of its executable mappings from before
+// each such change, with the generation the change started, oldest first
+// (--deferred only). Guarded by address_spaces_lock.
+std::unordered_map<pid_t, std::vector<std::pair<uint32_t, AddressSpace>>>
+    retired_spaces;
+
+// Mapping from process id to its data mappings, which page faults are
+// charged to (--page-faults only). Guarded by address_spaces_lock.
+std::unordered_map<pid_t, AddressSpace> data_spaces;
+
+// Mapping from thread id to the perf fds of its context-switch event
+// (--off-cpu only) and page-fault events (--page-faults only), which live
+// as long as its main event. Guarded by perf_libs_lock.
+std::unordered_map<pid_t, std::vector<int>> companion_fds;
+
+// Events that write into the ring buffer of another event, and so are never
+// read themselves (per-CPU mode with --pid only)
+std::vector<PerfLib> redirected_events;
+
+// Mapping from CPU to the perf fd whose ring buffer the events of every
+// thread on that CPU write into (per-CPU mode only)
+std::map<int, int> cpu_buffers;
+
+// Written once the main child has exited, to stop every shard
+int stop_fd;
 
-// Used for epoll
-int epoll_fd;
+// Readable once the profiling window is over (--duration), or the profiler is
+// interrupted while attached (--pid); -1 if unused. Both are watched by
+// shard 0 only.
+int timer_fd = -1;
+int signal_fd = -1;
+
+// Readable at every refresh of the live view (--top only), watched by shard 0
+int refresh_fd = -1;
+
+// Recent cycles per function shown by the live view (--top only)
+LiveTop live_top(TOP_DECAY);
 
 // Main child pid
 pid_t child_pid;
 
-// Total number of samples collected so far
+// Raw records of the run go here instead of being aggregated (--record only)
+RecordingWriter recording;
+
+// Total number of cycles sampled so far. Every sample counts for its period,
+// which the kernel may change from one sample to the next.
 static size_t sample_count = 0;
 
-void DeleteFromEpoll(int fd) {
+// Number of samples taken so far, the count sample_count adds up from.
+// Collectors of deferred samples add to it concurrently.
+std::atomic<uint64_t> samples_taken(0);
+
+// Command line options
+// When the kernel wakes a collector up to read a ring buffer
+enum WakeupPolicy {
+  WAKEUP_RECORD,    // as soon as there is a record
+  WAKEUP_BYTES,     // once a number of bytes is waiting
+  WAKEUP_EVENTS,    // every number of samples
+  WAKEUP_TICK,      // never, until nearly full; drain on a fixed tick instead
+  WAKEUP_ADAPTIVE,  // same, with a tick that follows how full buffers get
+};
+
+struct Options {
+  bool deferred = false;      // aggregate raw ips, symbolize at exit
+  size_t symbolize_jobs = 1;  // threads used to symbolize deferred samples
+  size_t collectors = 1;      // number of collector threads (shards)
+  bool per_cpu = false;       // one inherited event per CPU, not per thread
+  EventConfig event;          // settings of every perf event we open
+  std::string folded_file;    // per-thread folded stacks go here
+  std::string folded_process_file;  // whole-process folded stacks go here
+  std::string flamegraph_file;      // SVG flame graph goes here
+  std::string timeline_file;        // Chrome trace of the timeline goes here
+  double time_slice = 1;            // length of a timeline slice in ms
+  bool scalability = false;  // also report how well the threads overlap
+  bool annotate = false;  // also report the hottest lines of hot functions
+  bool off_cpu = false;   // also measure time off the CPU, and where threads
+                          // block
+  bool page_faults = false;  // also sample page faults, and report where
+                             // memory was first touched
+  std::string record_file;  // write raw records here instead of a report
+  std::string report_file;  // report on this recording instead of a run
+  std::string diff_file;    // compare another run against this one
+  DiffNormalization diff_by = DIFF_BY_SHARE;  // how runs are made comparable
+  double fail_above = -1;  // exit with 2 if a function regressed more than
+                           // this many percent, if not negative
+  pid_t attach_pid = 0;     // profile this running process instead of a command
+  double duration = 0;      // stop profiling after this many seconds, if not 0
+  double top = 0;  // refresh a live view this often in seconds, if not 0
+  bool self_stats = false;  // also report what the profiler itself costs
+  WakeupPolicy wakeup = WAKEUP_RECORD;  // when collectors read the buffers
+  uint64_t wakeup_value = 0;  // bytes, samples or tick in ms of the policy,
+                              // or 0 for its default
+};
+Options options;
+
+// Whether timed samples and thread lifetimes are kept, for the timeline and
+// the scalability report
+bool KeepTimes() {
+  return !options.timeline_file.empty() || options.scalability;
+}
+
+// Start tracking thread tid of process pid
+void TrackThread(pid_t pid, pid_t tid) {
+  {
+    std::lock_guard<std::mutex> guard(thread_names_lock);
+    thread_processes[tid] = pid;
+  }
+  std::lock_guard<std::mutex> guard(live_threads_lock);
+  if (exited_threads.erase(tid) == 0) live_threads.insert(tid);
+}
+
+// Stop tracking thread tid, which has exited
+// Return true if it was the last thread of the target
+bool UntrackThread(pid_t tid) {
+  std::lock_guard<std::mutex> guard(live_threads_lock);
+  if (live_threads.erase(tid) == 0) exited_threads.insert(tid);
+  return live_threads.empty();
+}
+
+// Return the process of thread tid. Threads that were running when the
+// profiler attached are only known from their samples, and belong to the
+// attached process.
+pid_t ProcessOf(pid_t tid) {
+  std::lock_guard<std::mutex> guard(thread_names_lock);
+  auto it = thread_processes.find(tid);
+  return it == thread_processes.end() ? child_pid : it->second;
+}
+
+// Return the raw sample tables of thread tid in process pid, under the
+// current generation of the mappings
+ThreadIps &GetThreadIps(Shard &shard, pid_t pid, pid_t tid) {
+  uint32_t generation = mapping_generation.load(std::memory_order_relaxed);
+  uint64_t key = ThreadIpsKey(tid, generation);
+  if (key != shard.last_key) {
+    auto it = shard.thread_ips.find(key);
+    if (it == shard.thread_ips.end()) {
+      it = shard.thread_ips.insert({key, ThreadIps()}).first;
+      it->second.pid = pid;
+      it->second.tid = tid;
+      it->second.generation = generation;
+    }
+    shard.last_key = key;
+    shard.last_ips = &it->second;
+  }
+  return *shard.last_ips;
+}
+
+// Keep a copy of the executable mappings of process pid, about to drop or
+// replace code, for the deferred samples taken before, and forget the
+// symbols cached for them. Call with address_spaces_lock held.
+void RetireAddressSpace(pid_t pid) {
+  ip_symbols.erase(pid);
+  AddressSpace &space = address_spaces[pid];
+  if (!options.deferred || space.size() == 0) return;
+  retired_spaces[pid].push_back({++mapping_generation, space});
+}
+
+// Return the executable mappings of process pid as they were at generation
+AddressSpace &SpaceAt(pid_t pid, uint32_t generation) {
+  auto it = retired_spaces.find(pid);
+  if (it != retired_spaces.end()) {
+    for (auto &retired : it->second) {
+      if (generation < retired.first) return retired.second;
+    }
+  }
+  return address_spaces[pid];
+}
+
+// Return the stats of shard, or NULL unless --self-stats is on
+SelfStats *StatsOf(Shard &shard) {
+  return options.self_stats ? &shard.stats : NULL;
+}
+
+// Return the function containing ip in space, or NULL if there is none,
+// timing the lookup into stats unless it is NULL
+const char *LookupFunction(AddressSpace &space, uint64_t ip,
+                           SelfStats *stats) {
+  if (stats == NULL) {
+    return address_to_function(space, reinterpret_cast<void *>(ip));
+  }
+  uint64_t start = MonotonicNs();
+  const char *ret = address_to_function(space, reinterpret_cast<void *>(ip));
+  stats->lookups.Add(MonotonicNs() - start);
+  if (ret == NULL) stats->unresolved++;
+  return ret;
+}
+
+// Return the symbol id of the function containing ip in process pid
+// Cache hits and lookups are counted into stats unless it is NULL
+uint32_t ResolveSymbol(pid_t pid, uint64_t ip, SelfStats *stats = NULL) {
+  auto &symbols = ip_symbols[pid];
+  auto it = symbols.find(ip);
+  if (it != symbols.end()) {
+    if (stats != NULL) stats->symbol_hits++;
+    return it->second;
+  }
+
+  if (stats != NULL) stats->symbol_misses++;
+  const char *ret = LookupFunction(address_spaces[pid], ip, stats);
+  uint32_t id = symbol_names.Intern(ret == NULL ? "somewhere" : ret);
+  symbols.insert({ip, id});
+  return id;
+}
+
+void DeleteFromEpoll(int epoll_fd, int fd) {
   epoll_event ev = {.events = EPOLLIN, {.fd = fd}};
   REQUIRE(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev) != -1)
       << "epoll_ctl DEL failed: " << strerror(errno);
 }
 
-void AddToEpoll(int fd) {
+void AddToEpoll(int epoll_fd, int fd) {
   epoll_event ev = {.events = EPOLLIN, {.fd = fd}};
   REQUIRE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != -1)
       << "epoll_ctl ADD failed: " << strerror(errno);
 }
 
+// Open the events that sample thread tid, spreading their buffers over the
+// shards, and start them if start is set. Threads the thread creates later
+// are picked up through FORK records or, in per-CPU mode, inherit the events.
+// Return false if the thread has already gone away
+bool OpenThreadEvents(pid_t tid, bool start) {
+  std::lock_guard<std::mutex> guard(perf_libs_lock);
+  if (!options.per_cpu) {
+    PerfLib p;
+    int perf_fd = p.PerfEventOpen(tid, /*cpu=*/-1, options.event);
+    if (perf_fd == -1) return false;
+
+    // The context-switch and page-fault events go to the same shard, which
+    // then sees all the switches of the thread in order, and its exit
+    std::vector<PerfLib> companions;
+    if (options.off_cpu) {
+      companions.emplace_back();
+      if (companions.back().SwitchEventOpen(tid, options.event) == -1) {
+        companions.pop_back();
+        for (PerfLib &c : companions) c.Close();
+        p.Close();
+        return false;
+      }
+    }
+    if (options.page_faults) {
+      companions.emplace_back();
+      if (companions.back().FaultEventOpen(tid, options.event) == -1) {
+        companions.pop_back();
+        for (PerfLib &c : companions) c.Close();
+        p.Close();
+        return false;
+      }
+    }
+
+    Shard &shard = shards[next_shard++ % shards.size()];
+    if (start) p.StartSampling();
+    perf_libs.insert({perf_fd, p});
+    shard.perf_fds.insert(perf_fd);
+    AddToEpoll(shard.epoll_fd, perf_fd);
+    for (PerfLib &c : companions) {
+      if (start) c.StartSampling();
+      perf_libs.insert({c.fd(), c});
+      companion_fds[tid].push_back(c.fd());
+      shard.perf_fds.insert(c.fd());
+      AddToEpoll(shard.epoll_fd, c.fd());
+    }
+    return true;
+  }
+
+  // One event per CPU. The first thread's events own one buffer per CPU, and
+  // the events of any other thread write into those. They are only started
+  // and registered once every CPU's is open; if the thread goes away
+  // between CPUs, the ones opened so far are closed again.
+  std::vector<std::pair<int, PerfLib>> buffers;  // new buffers, by cpu
+  std::vector<PerfLib> redirected;
+  for (int cpu : OnlineCpus()) {
+    auto buffer = cpu_buffers.find(cpu);
+    PerfLib p;
+    int perf_fd = buffer == cpu_buffers.end()
+                      ? p.PerfEventOpen(tid, cpu, options.event)
+                      : p.PerfEventOpen(tid, cpu, options.event,
+                                        &perf_libs[buffer->second]);
+    if (perf_fd == -1) {
+      for (PerfLib &r : redirected) r.Close();
+      for (auto &b : buffers) b.second.Close();
+      return false;
+    }
+    if (buffer == cpu_buffers.end()) {
+      buffers.push_back({cpu, p});
+    } else {
+      redirected.push_back(p);
+    }
+  }
+
+  for (auto &b : buffers) {
+    PerfLib &p = b.second;
+    if (start) p.StartSampling();
+    Shard &shard = shards[next_shard++ % shards.size()];
+    AddToEpoll(shard.epoll_fd, p.fd());
+    shard.perf_fds.insert(p.fd());
+    perf_libs.insert({p.fd(), p});
+    cpu_buffers.insert({b.first, p.fd()});
+  }
+  for (PerfLib &p : redirected) {
+    if (start) p.StartSampling();
+    redirected_events.push_back(p);
+  }
+  return true;
+}
+
+// Write the seeded mappings of process pid to the shard's part of the
+// recording as MMAP2 records, so a report starts from the same address space
+void RecordAddressSpace(Shard &shard, pid_t pid) {
+  std::vector<char> data;
+  for (const Mapping &m : address_spaces[pid].mappings()) {
+    // Records are padded to a multiple of 8 bytes
+    size_t size = sizeof(perf_event_header) + sizeof(Mmap2Record) +
+                  m.filename.size() + 1;
+    size = (size + 7) & ~static_cast<size_t>(7);
+    data.assign(size, 0);
+
+    perf_event_header *header = reinterpret_cast<perf_event_header *>(&data[0]);
+    header->type = PERF_RECORD_MMAP2;
+    header->size = size;
+    Mmap2Record *mmap_record = reinterpret_cast<Mmap2Record *>(header + 1);
+    mmap_record->pid = pid;
+    mmap_record->tid = pid;
+    mmap_record->addr = m.start;
+    mmap_record->len = m.end - m.start;
+    mmap_record->pgoff = m.pgoff;
+    mmap_record->prot = PROT_EXEC;
+    memcpy(mmap_record->filename, m.filename.c_str(), m.filename.size());
+    shard.record_buffer.Append(recording, header, shard.record_time);
+  }
+}
+
+// Write the data mappings of process pid to the shard's part of the recording
+// as MMAP records, as the page-fault events report them (--page-faults only)
+void RecordDataSpace(Shard &shard, pid_t pid) {
+  std::vector<char> data;
+  for (const Mapping &m : data_spaces[pid].mappings()) {
+    size_t size = sizeof(perf_event_header) + sizeof(MmapRecord) +
+                  m.filename.size() + 1;
+    size = (size + 7) & ~static_cast<size_t>(7);
+    data.assign(size, 0);
+
+    perf_event_header *header = reinterpret_cast<perf_event_header *>(&data[0]);
+    header->type = PERF_RECORD_MMAP;
+    header->size = size;
+    MmapRecord *mmap_record = reinterpret_cast<MmapRecord *>(header + 1);
+    mmap_record->pid = pid;
+    mmap_record->tid = pid;
+    mmap_record->addr = m.start;
+    mmap_record->len = m.end - m.start;
+    mmap_record->pgoff = m.pgoff;
+    memcpy(mmap_record->filename, m.filename.c_str(), m.filename.size());
+    shard.record_buffer.Append(recording, header, shard.record_time);
+  }
+}
+
+// Reload the name and mappings of the new process pid from /proc. It may have
+// exec'd before its events were open, and so before we could see the COMM
+// and MMAP2 records of the new image.
+void RefreshProcess(Shard &shard, pid_t pid) {
+  std::ifstream comm_file("/proc/" + std::to_string(pid) + "/comm");
+  std::string comm;
+  if (std::getline(comm_file, comm)) {
+    std::lock_guard<std::mutex> guard(thread_names_lock);
+    thread_names[pid] = comm;
+  }
+
+  std::lock_guard<std::mutex> guard(address_spaces_lock);
+  AddressSpace space;
+  if (!space.LoadFromProc(pid)) return;
+  RetireAddressSpace(pid);
+  address_spaces[pid] = std::move(space);
+  if (options.page_faults) data_spaces[pid].LoadFromProc(pid, /*data=*/true);
+  if (options.record_file.empty()) return;
+
+  // Record it as an exec, so a report also drops the copy of the parent
+  size_t size =
+      sizeof(perf_event_header) + sizeof(CommRecord) + comm.size() + 1;
+  size = (size + 7) & ~static_cast<size_t>(7);
+  std::vector<char> data(size, 0);
+  perf_event_header *header = reinterpret_cast<perf_event_header *>(&data[0]);
+  header->type = PERF_RECORD_COMM;
+  header->misc = PERF_RECORD_MISC_COMM_EXEC;
+  header->size = size;
+  CommRecord *comm_record = reinterpret_cast<CommRecord *>(header + 1);
+  comm_record->pid = pid;
+  comm_record->tid = pid;
+  memcpy(comm_record->comm, comm.c_str(), comm.size());
+  shard.record_buffer.Append(recording, header, shard.record_time);
+  RecordAddressSpace(shard, pid);
+  if (options.page_faults) RecordDataSpace(shard, pid);
+}
+
+// Process one record read from perf_lib's ring buffer, or from a recording
+// when perf_lib is NULL
+// Return true if the record is the main child's exit
+// Otherwise, return false
+bool ProcessRecord(Shard &shard, PerfLib *perf_lib, int type, uint16_t misc,
+                   void *event_data) {
+  if (type == PERF_RECORD_SAMPLE) {
+    Sample sample;
+    DecodeSample(SampleType(options.event), event_data, &sample);
+    pid_t pid = static_cast<pid_t>(sample.pid);
+    pid_t tid = static_cast<pid_t>(sample.tid);
+    samples_taken++;
+
+    // Tracepoints are sampled in the kernel; charge them to the user code
+    // that got there, the innermost frame of the user callchain
+    if ((misc & PERF_RECORD_MISC_CPUMODE_MASK) == PERF_RECORD_MISC_KERNEL) {
+      for (uint64_t i = 0; i < sample.nr; i++) {
+        if (sample.ips[i] < PERF_CONTEXT_MAX) {
+          sample.ip = sample.ips[i];
+          break;
+        }
+      }
+    }
+
+    if (KeepTimes()) {
+      shard.timed_samples.push_back(
+          {sample.time, sample.ip, sample.period, pid, tid});
+    }
+
+    if (options.annotate) shard.process_ips[pid].Add(sample.ip, sample.period);
+
+    // Counters run all the time, so each sample gets what was counted since
+    // the thread's previous sample
+    CounterValues counted;
+    if (options.event.counters) {
+      CounterValues &last = shard.last_counters[tid];
+      for (int i = 0; i < NUM_COUNTERS; i++) {
+        counted.value[i] = sample.counters[i] - last.value[i];
+        last.value[i] = sample.counters[i];
+      }
+    }
+
+    if (options.deferred) {
+      // Just count the raw ip; names are resolved once the target exits
+      ThreadIps &thread = GetThreadIps(shard, pid, tid);
+      thread.ips.Add(sample.ip, sample.period);
+      if (options.event.callchain) {
+        thread.stacks.AddStack(sample.ips, sample.nr, sample.period);
+      }
+      if (options.event.counters) thread.counters[sample.ip].Add(counted);
+      return false;
+    }
+
+    std::string function_name = "";
+    const char *ret =
+        LookupFunction(address_spaces[pid], sample.ip, StatsOf(shard));
+    if (ret == NULL) {
+      // NOTE: We cannot find the function name for this address
+      // Most likely, the address resides in libc
+      function_name = "somewhere";
+    } else {
+      function_name = std::string(ret);
+    }
+
+    // Update bookkeeping data structures
+    thread_mapping[tid][function_name] += sample.period;
+    thread_sample_count[tid] += sample.period;
+    sample_count += sample.period;
+    if (options.event.counters) {
+      thread_counters[tid][function_name].Add(counted);
+    }
+
+    if (options.event.callchain) {
+      // Replace each frame with its function before adding the path
+      std::vector<uint64_t> frames(sample.ips, sample.ips + sample.nr);
+      for (uint64_t &frame : frames) {
+        if (frame < PERF_CONTEXT_MAX) {
+          frame = ResolveSymbol(pid, frame, StatsOf(shard));
+        }
+      }
+      thread_cct[tid].AddStack(frames.data(), frames.size(), sample.period);
+    }
+    if (options.top != 0) {
+      live_top.Add(tid, ResolveSymbol(pid, sample.ip, StatsOf(shard)),
+                   sample.period);
+    }
+  } else if (type == PERF_RECORD_FORK) {
+    // Parse tid out of data
+    TaskRecord *fork_record = reinterpret_cast<TaskRecord *>(event_data);
+    INFO << "Fork Reocrd = tid: " << fork_record->tid
+         << ", ppid: " << fork_record->ppid;
+    pid_t tid = fork_record->tid;
+    if (KeepTimes()) {
+      shard.thread_starts[tid] = fork_record->time;
+    }
+
+    // A new thread starts with its parent's name, and a new process with a
+    // copy of its parent's address space
+    pid_t pid = fork_record->pid;
+    pid_t ppid = fork_record->ppid;
+    {
+      std::lock_guard<std::mutex> guard(thread_names_lock);
+      auto name = thread_names.find(fork_record->ptid);
+      if (name != thread_names.end()) thread_names[tid] = name->second;
+    }
+    if (pid != ppid) {
+      std::lock_guard<std::mutex> guard(address_spaces_lock);
+      if (address_spaces.count(ppid) != 0) {
+        address_spaces[pid] = address_spaces[ppid];
+      }
+      if (data_spaces.count(ppid) != 0) data_spaces[pid] = data_spaces[ppid];
+    }
+
+    // Every thread of the target is followed, in new processes too
+    TrackThread(pid, tid);
+
+    // In per-CPU mode the new thread inherits the events already open on
+    // every CPU. When reading a recording there is nothing to open.
+    if (options.per_cpu || perf_lib == NULL) return false;
+
+    // We may have missed the thread entirely
+    if (!OpenThreadEvents(tid, /*start=*/true)) {
+      INFO << "We missed the thread " << tid;
+      return UntrackThread(tid);
+    }
+    if (tid == pid && pid != ppid) RefreshProcess(shard, pid);
+  } else if (type == PERF_RECORD_EXIT) {
+    // Parse tid out of data
+    TaskRecord *exit_record = reinterpret_cast<TaskRecord *>(event_data);
+    INFO << "Exit Reocrd = tid: " << exit_record->tid
+         << ", ptid: " << exit_record->ptid;
+    pid_t tid = exit_record->tid;
+    if (KeepTimes()) {
+      shard.thread_ends[tid] = exit_record->time;
+    }
+
+    // The thread ran from its last switch in until it exited
+    if (options.off_cpu) {
+      OffCpuThread &thread = shard.off_cpu[tid];
+      if (thread.last_in != 0 && exit_record->time > thread.last_in) {
+        thread.on_cpu += exit_record->time - thread.last_in;
+        thread.last_in = 0;
+      }
+    }
+
+    // Profiling ends with the last thread of the target, not the main child
+    return UntrackThread(tid);
+  } else if (type == PERF_RECORD_MMAP2) {
+    Mmap2Record *mmap_record = reinterpret_cast<Mmap2Record *>(event_data);
+    std::lock_guard<std::mutex> guard(address_spaces_lock);
+    AddressSpace &space = address_spaces[mmap_record->pid];
+    if (space.Overwrites(mmap_record->addr, mmap_record->len,
+                         mmap_record->pgoff, mmap_record->filename)) {
+      RetireAddressSpace(mmap_record->pid);
+    }
+    space.AddMapping(mmap_record->addr, mmap_record->len, mmap_record->pgoff,
+                     mmap_record->filename);
+  } else if (type == PERF_RECORD_COMM) {
+    CommRecord *comm_record = reinterpret_cast<CommRecord *>(event_data);
+    {
+      std::lock_guard<std::mutex> guard(thread_names_lock);
+      thread_names[comm_record->tid] = comm_record->comm;
+    }
+
+    // The old image is gone after exec; the new one is reported through
+    // MMAP2 records that follow this one
+    if (misc & PERF_RECORD_MISC_COMM_EXEC) {
+      std::lock_guard<std::mutex> guard(address_spaces_lock);
+      RetireAddressSpace(comm_record->pid);
+      address_spaces[comm_record->pid].Clear();
+
+      // Only some data mappings of the new image are reported (the stack is
+      // not), so take them from /proc while the process still runs, and
+      // record them for the report
+      if (options.page_faults) {
+        pid_t pid = comm_record->pid;
+        data_spaces[pid].Clear();
+        if (perf_lib != NULL && data_spaces[pid].LoadFromProc(pid, true) &&
+            !options.record_file.empty()) {
+          RecordDataSpace(shard, pid);
+        }
+      }
+    }
+  } else if (type == RECORD_MINOR_FAULT_SAMPLE ||
+             type == RECORD_MAJOR_FAULT_SAMPLE) {
+    Sample sample;
+    DecodeSample(FAULT_SAMPLE_TYPE, event_data, &sample);
+    shard.page_faults.Add(sample.pid, sample.tid, sample.time, sample.addr,
+                          sample.cpu, type == RECORD_MAJOR_FAULT_SAMPLE,
+                          sample.ip, sample.ips, sample.nr);
+  } else if (type == PERF_RECORD_MMAP) {
+    MmapRecord *mmap_record = reinterpret_cast<MmapRecord *>(event_data);
+    std::lock_guard<std::mutex> guard(address_spaces_lock);
+    data_spaces[mmap_record->pid].AddMapping(
+        mmap_record->addr, mmap_record->len, mmap_record->pgoff,
+        mmap_record->filename);
+  } else if (type == RECORD_SWITCH_SAMPLE) {
+    // The thread is about to be switched out; keep its callchain for when we
+    // know how long it was away
+    Sample sample;
+    DecodeSample(SWITCH_SAMPLE_TYPE, event_data, &sample);
+    OffCpuThread &thread = shard.off_cpu[sample.tid];
+    thread.out_stack.assign(sample.ips, sample.ips + sample.nr);
+  } else if (type == PERF_RECORD_SWITCH) {
+    SwitchRecord *switch_record = reinterpret_cast<SwitchRecord *>(event_data);
+    OffCpuThread &thread = shard.off_cpu[switch_record->tid];
+    thread.pid = switch_record->pid;
+    uint64_t time = switch_record->time;
+    if (misc & PERF_RECORD_MISC_SWITCH_OUT) {
+      if (thread.last_in != 0) thread.on_cpu += time - thread.last_in;
+      thread.last_in = 0;
+      thread.last_out = time;
+      thread.was_preempted = misc & PERF_RECORD_MISC_SWITCH_OUT_PREEMPT;
+    } else {
+      if (thread.last_out != 0) {
+        uint64_t away = time - thread.last_out;
+        if (thread.was_preempted) {
+          thread.preempted += away;
+        } else {
+          thread.blocked += away;
+          thread.sites.AddStack(thread.out_stack.data(),
+                                thread.out_stack.size(), away);
+        }
+      }
+      thread.last_out = 0;
+      thread.last_in = time;
+      thread.out_stack.clear();
+    }
+  } else if (type == PERF_RECORD_LOST) {
+    // The buffer was full and the kernel had to drop records
+    LostRecord *lost_record = reinterpret_cast<LostRecord *>(event_data);
+    if (perf_lib == NULL) {
+      // Recordings store lost records with their source instead
+    } else if (perf_lib->cpu() != -1) {
+      shard.cpu_lost[perf_lib->cpu()] += lost_record->lost;
+    } else {
+      shard.thread_lost[perf_lib->tid()] += lost_record->lost;
+    }
+  } else {
+    INFO << "Found a missing record!";
+  }
+  return false;
+}
+
+// Append a record read from perf_lib's ring buffer to the shard's part of
+// the recording
+void RecordRaw(Shard &shard, PerfLib *perf_lib, int type, void *event_data) {
+  perf_event_header *header = reinterpret_cast<perf_event_header *>(
+      static_cast<char *>(event_data) - sizeof(perf_event_header));
+  uint64_t sample_type = perf_lib->switch_event() ? SWITCH_SAMPLE_TYPE
+                         : perf_lib->fault_event() ? FAULT_SAMPLE_TYPE
+                                                   : SampleType(options.event);
+  shard.record_time = RecordTime(sample_type, header);
+
+  if (type == PERF_RECORD_LOST) {
+    LostRecord *lost_record = reinterpret_cast<LostRecord *>(event_data);
+    LostSourceRecord source;
+    source.header.type = RECORD_LOST_SOURCE;
+    source.header.misc = 0;
+    source.header.size = sizeof(source);
+    source.tid = perf_lib->cpu() == -1 ? perf_lib->tid() : -1;
+    source.cpu = perf_lib->cpu();
+    source.lost = lost_record->lost;
+    shard.record_buffer.Append(recording, &source.header, shard.record_time);
+  } else {
+    if (static_cast<int>(header->type) != type) {
+      // A record whose type we changed, stored with its new type
+      std::vector<char> copy(reinterpret_cast<char *>(header),
+                             reinterpret_cast<char *>(header) + header->size);
+      header = reinterpret_cast<perf_event_header *>(copy.data());
+      header->type = type;
+      shard.record_buffer.Append(recording, header, shard.record_time);
+    } else {
+      shard.record_buffer.Append(recording, header, shard.record_time);
+    }
+  }
+}
+
 // Handle the record with corresponding fd
-// Return true if the corresponding thread has exited
+// Return true if the main child has exited
 // Otherwise, return false
-bool HandleRecord(int fd) {
+bool HandleRecord(Shard &shard, int fd) {
   bool main_child_exited = false;
   bool has_exited = false;
   int type;
-  while (perf_libs[fd].HasNextRecord()) {
-    void *event_data = perf_libs[fd].GetNextRecord(&type);
-
-    if (type == PERF_RECORD_SAMPLE) {
-      SampleRecord *sample_record =
-          reinterpret_cast<SampleRecord *>(event_data);
-      void *ip = reinterpret_cast<void *>(sample_record->ip);
-      pid_t tid = static_cast<pid_t>(sample_record->tid);
-
-      // NOTE: Only happen when sample period is not large enough (<= 1000000)
-      if (tid == 0 || tid > 100000) {
-        INFO << "Found a wierd record: tid = " << tid << ", ip = " << ip;
-      }
-
-      std::string function_name = "";
-      const char *ret = address_to_function(tid, ip);
-      if (ret == NULL) {
-        // NOTE: We cannot find the function name for this address
-        // Most likely, the address resides in libc
-        function_name = "somewhere";
-      } else {
-        function_name = std::string(ret);
-      }
-
-      // Update bookkeeping data structures
-      thread_mapping[tid][function_name]++;
-      thread_sample_count[tid]++;
-      sample_count++;
-
-      // TODO: Integrates callchain
-      // Callchain works but since we cannot retrieve most of the function name,
-      // this is useless for now.
-
-      /* uint64_t num_funcs = sample_record->nr; */
-      /* uint64_t *ips = reinterpret_cast<uint64_t *>(&(sample_record->ips)); */
-      /* for (size_t i = 0; i < num_funcs; ++i) { */
-      /*   void *cur_ip = reinterpret_cast<void *>(ips[i]); */
-      /*   const char *ret = address_to_function(tid, cur_ip); */
-      /*   if (ret == NULL) { */
-      /*     function_name = "callchain somewhere"; */
-      /*   } else { */
-      /*     function_name = std::string(ret); */
-      /*     INFO << function_name; */
-      /*   } */
-      /* } */
-    } else if (type == PERF_RECORD_FORK) {
-      // Parse tid out of data
-      TaskRecord *fork_record = reinterpret_cast<TaskRecord *>(event_data);
-      INFO << "Fork Reocrd = tid: " << fork_record->tid
-           << ", ppid: " << fork_record->ppid;
-      pid_t tid = fork_record->tid;
-
-      // Start perf_event_open
-      PerfLib p;
-      int perf_fd = p.PerfEventOpen(tid);
-
-      // We missed the thread entirely
-      if (perf_fd == -1) {
-        INFO << "We missed the thread " << tid;
-        // Do not start sampling since perf_event_open failed
-        continue;
-      }
-      p.StartSampling();
+  uint16_t misc;
 
-      // Update global bookkeeping
-      AddToEpoll(perf_fd);
-      perf_libs.insert({perf_fd, p});
-    } else if (type == PERF_RECORD_EXIT) {
-      has_exited = true;
+  // The fd may have been closed by an earlier record of the same wakeup
+  PerfLib *perf_lib;
+  {
+    std::lock_guard<std::mutex> guard(perf_libs_lock);
+    auto it = perf_libs.find(fd);
+    if (it == perf_libs.end()) return false;
+    perf_lib = &it->second;
+  }
 
-      // Parse tid out of data
-      TaskRecord *exit_record = reinterpret_cast<TaskRecord *>(event_data);
-      INFO << "Exit Reocrd = tid: " << exit_record->tid
-           << ", ptid: " << exit_record->ptid;
-      pid_t tid = exit_record->tid;
+  SelfStats *stats = StatsOf(shard);
+  while (perf_lib->BeginBatch()) {
+    shard.max_fill = std::max(
+        shard.max_fill, static_cast<double>(perf_lib->batch_remaining()) /
+                            perf_lib->data_size());
+    if (stats != NULL) {
+      stats->fill[10 * perf_lib->batch_remaining() / perf_lib->data_size()]++;
+    }
+    void *event_data;
+    while ((event_data = perf_lib->GetNextRecord(&type, &misc)) != NULL) {
+      // Asking for data mappings also brings fork and exit records, which
+      // the thread's main event already has
+      if (perf_lib->fault_event() &&
+          (type == PERF_RECORD_FORK || type == PERF_RECORD_EXIT)) {
+        continue;
+      }
+      // The thread's switches up to its exit wait in its context-switch
+      // event; handle them first, so the time from its last switch in is
+      // not also counted by the exit
+      if (type == PERF_RECORD_EXIT && !options.per_cpu &&
+          !perf_lib->switch_event()) {
+        std::vector<int> companions;
+        {
+          std::lock_guard<std::mutex> guard(perf_libs_lock);
+          auto it = companion_fds.find(perf_lib->tid());
+          if (it != companion_fds.end()) companions = it->second;
+        }
+        for (int companion_fd : companions) HandleRecord(shard, companion_fd);
+      }
 
-      // Update global bookkeeping
-      DeleteFromEpoll(fd);
+      uint64_t start = stats != NULL ? MonotonicNs() : 0;
+      if (type == PERF_RECORD_SAMPLE && perf_lib->switch_event()) {
+        type = RECORD_SWITCH_SAMPLE;
+      } else if (type == PERF_RECORD_SAMPLE && perf_lib->fault_event()) {
+        // The sample starts with the id of the event that took it
+        uint64_t id = *static_cast<uint64_t *>(event_data);
+        type = id == perf_lib->major_fault_id() ? RECORD_MAJOR_FAULT_SAMPLE
+                                                : RECORD_MINOR_FAULT_SAMPLE;
+      }
+      if (!options.record_file.empty()) {
+        RecordRaw(shard, perf_lib, type, event_data);
+      }
 
-      // Check to see if the main child has exited or not
-      if (tid == child_pid) {
+      // Samples and switches are only aggregated when there is no recording
+      // to do it later
+      bool process = options.record_file.empty() ||
+                     (type != PERF_RECORD_SAMPLE &&
+                      type != RECORD_SWITCH_SAMPLE &&
+                      type != PERF_RECORD_SWITCH &&
+                      type != RECORD_MINOR_FAULT_SAMPLE &&
+                      type != RECORD_MAJOR_FAULT_SAMPLE);
+      if (process && ProcessRecord(shard, perf_lib, type, misc, event_data)) {
         main_child_exited = true;
       }
-    } else {
-      INFO << "Found a missing record!";
+      if (stats != NULL) stats->records[type].Add(MonotonicNs() - start);
+
+      // Update global bookkeeping. A per-CPU buffer outlives the threads
+      // that ran on that CPU.
+      if (type == PERF_RECORD_EXIT && !options.per_cpu && !has_exited) {
+        DeleteFromEpoll(shard.epoll_fd, fd);
+        has_exited = true;
+      }
     }
+    perf_lib->EndBatch();
   }
   if (has_exited) {
-    perf_libs.erase(fd);
+    std::vector<int> companions;
+    {
+      std::lock_guard<std::mutex> guard(perf_libs_lock);
+      pid_t tid = perf_lib->tid();
+      perf_lib->Close();
+      perf_libs.erase(fd);
+      shard.perf_fds.erase(fd);
+      auto it = companion_fds.find(tid);
+      if (it != companion_fds.end()) {
+        companions = std::move(it->second);
+        companion_fds.erase(it);
+      }
+    }
+
+    // The thread's context-switch and page-fault events go with it, once
+    // their last records are read
+    for (int companion_fd : companions) {
+      HandleRecord(shard, companion_fd);
+      DeleteFromEpoll(shard.epoll_fd, companion_fd);
+      std::lock_guard<std::mutex> guard(perf_libs_lock);
+      perf_libs[companion_fd].Close();
+      perf_libs.erase(companion_fd);
+      shard.perf_fds.erase(companion_fd);
+    }
   }
   return main_child_exited;
 }
 
-void RunProfiler() {
+// Resolve every distinct (process, ip) pair seen in --deferred mode once, and
+// fold the raw counts into the same tables immediate mode fills in
+void SymbolizeDeferredSamples() {
+  // Collect distinct ips per address space, each process' as it was when the
+  // samples were taken. Every address space is looked up here, up front;
+  // the tables must not be modified while other threads read them.
+  std::vector<std::pair<AddressSpace *, uint64_t>> unique_ips;
+  std::unordered_map<AddressSpace *, std::unordered_map<uint64_t, size_t>>
+      ip_index;
+  for (auto &t : thread_ips) {
+    AddressSpace *space = &SpaceAt(t.second.pid, t.second.generation);
+    auto &index = ip_index[space];
+    auto add = [&](uint64_t ip) {
+      if (index.insert({ip, unique_ips.size()}).second) {
+        unique_ips.push_back({space, ip});
+      }
+    };
+    t.second.ips.ForEach([&](uint64_t ip, uint64_t) { add(ip); });
+    t.second.stacks.ForEachKey(add);
+  }
+
+  // Resolve them, split evenly over the symbolization threads
+  std::vector<const char *> names(unique_ips.size());
+  auto resolve = [&](size_t begin, size_t end, SelfStats *stats) {
+    for (size_t i = begin; i < end; i++) {
+      names[i] = LookupFunction(*unique_ips[i].first, unique_ips[i].second,
+                                stats);
+    }
+  };
+
+  size_t jobs = std::max<size_t>(1, std::min(options.symbolize_jobs,
+                                             unique_ips.size()));
+  std::vector<std::thread> workers;
+  std::vector<SelfStats> job_stats(jobs);
+  auto stats_of = [&](size_t j) {
+    return options.self_stats ? &job_stats[j] : NULL;
+  };
+  size_t chunk = (unique_ips.size() + jobs - 1) / jobs;
+  for (size_t j = 1; j < jobs; j++) {
+    workers.emplace_back(resolve, j * chunk,
+                         std::min(unique_ips.size(), (j + 1) * chunk),
+                         stats_of(j));
+  }
+  resolve(0, std::min(unique_ips.size(), chunk), stats_of(0));
+  for (auto &w : workers) w.join();
+  for (SelfStats &stats : job_stats) shards[0].stats.Merge(stats);
+
+  // Fold the counts into the per-thread function tables
+  for (auto &t : thread_ips) {
+    pid_t tid = t.second.tid;
+    thread_processes.insert({tid, t.second.pid});
+    auto &index = ip_index[&SpaceAt(t.second.pid, t.second.generation)];
+    function_freq_t &functions = thread_mapping[tid];
+    t.second.ips.ForEach([&](uint64_t ip, uint64_t count) {
+      const char *ret = names[index[ip]];
+      functions[ret == NULL ? "somewhere" : ret] += count;
+    });
+    thread_sample_count[tid] += t.second.ips.total();
+    sample_count += t.second.ips.total();
+    for (auto &c : t.second.counters) {
+      const char *ret = names[index[c.first]];
+      thread_counters[tid][ret == NULL ? "somewhere" : ret].Add(c.second);
+    }
+
+    if (options.event.callchain) {
+      thread_cct[tid].Merge(t.second.stacks.Remap([&](uint64_t ip) -> uint64_t {
+        const char *ret = names[index[ip]];
+        return symbol_names.Intern(ret == NULL ? "somewhere" : ret);
+      }));
+    }
+  }
+  thread_ips.clear();
+}
+
+// Return how well a function used the CPU, going by its counters
+std::string CounterRates(const CounterValues &counters) {
+  const uint64_t *value = counters.value;
+  if (value[COUNTER_CYCLES] == 0 || value[COUNTER_INSTRUCTIONS] == 0) {
+    return ", no instructions counted";
+  }
+  double kilo_instructions = value[COUNTER_INSTRUCTIONS] / 1000.0;
+  char rates[128];
+  snprintf(rates, sizeof(rates),
+           ", IPC %.2f, %.2f cache and %.2f branch misses per 1000 "
+           "instructions",
+           static_cast<double>(value[COUNTER_INSTRUCTIONS]) /
+               value[COUNTER_CYCLES],
+           value[COUNTER_CACHE_MISSES] / kilo_instructions,
+           value[COUNTER_BRANCH_MISSES] / kilo_instructions);
+  return rates;
+}
+
+// Print the exclusive and inclusive cycles of every function on a thread's
+// call paths, most expensive call path first, along with the counters of
+// each function (--counters only)
+void PrintCallGraphCosts(
+    const CallingContextTree &cct, size_t total_count,
+    std::unordered_map<std::string, CounterValues> &counters) {
+  const char *unit = EventUnit(options.event);
+  std::vector<std::pair<uint64_t, FunctionCost>> costs;
+  for (auto &c : cct.Costs()) costs.push_back(c);
+  std::sort(costs.begin(), costs.end(),
+            [](const std::pair<uint64_t, FunctionCost> &a,
+               const std::pair<uint64_t, FunctionCost> &b) {
+              return a.second.inclusive > b.second.inclusive;
+            });
+
+  for (const auto &c : costs) {
+    std::cout << "    " << symbol_names.Name(c.first) << ": "
+              << c.second.exclusive << " " << unit << " "
+              << static_cast<double>(c.second.exclusive) / total_count * 100
+              << "% self, " << c.second.inclusive << " " << unit << " "
+              << static_cast<double>(c.second.inclusive) / total_count * 100
+              << "% total";
+    if (options.event.counters) {
+      std::cout << CounterRates(counters[symbol_names.Name(c.first)]);
+    }
+    std::cout << std::endl;
+  }
+}
+
+// Write the number of samples and their unit next to the folded stacks at
+// folded_file, for --diff
+void WriteFoldedSamplesFile(const std::string &folded_file) {
+  std::string path = folded_file + FOLDED_SAMPLES_SUFFIX;
+  std::ofstream out(path);
+  PREFER(out) << "Failed to open " << path;
+  WriteFoldedSamples(out, samples_taken, EventUnit(options.event));
+}
+
+// Write the folded stacks and flame graph requested on the command line
+void WriteCallGraphFiles() {
+  // One tree for the whole process, with each thread as an extra outermost
+  // frame, and one with the threads merged
+  CallingContextTree by_thread;
+  CallingContextTree merged;
+  for (auto &t : thread_cct) {
+    uint32_t thread_key =
+        symbol_names.Intern("thread " + std::to_string(t.first));
+    by_thread.MergeUnder(thread_key, t.second);
+    merged.Merge(t.second);
+  }
+
+  if (!options.folded_file.empty()) {
+    std::ofstream out(options.folded_file);
+    PREFER(out) << "Failed to open " << options.folded_file;
+    WriteFoldedStacks(out, by_thread, symbol_names);
+    WriteFoldedSamplesFile(options.folded_file);
+  }
+  if (!options.folded_process_file.empty()) {
+    std::ofstream out(options.folded_process_file);
+    PREFER(out) << "Failed to open " << options.folded_process_file;
+    WriteFoldedStacks(out, merged, symbol_names);
+    WriteFoldedSamplesFile(options.folded_process_file);
+  }
+  if (!options.flamegraph_file.empty()) {
+    std::ofstream out(options.flamegraph_file);
+    PREFER(out) << "Failed to open " << options.flamegraph_file;
+    WriteFlameGraph(out, by_thread, symbol_names, "g-profiler flame graph",
+                    EventUnit(options.event));
+  }
+}
+
+// Print the hottest source lines of every function with at least 1% of the
+// cycles, with the instructions in each line that were sampled most
+void PrintAnnotation() {
+  // Cycles by function, by line in each function, and by instruction in each
+  // line. Instructions are named by the address they were linked at.
+  struct LineCost {
+    uint64_t cycles = 0;
+    std::map<uintptr_t, uint64_t> instructions;
+  };
+  struct FunctionLines {
+    uint64_t cycles = 0;
+    std::map<std::string, LineCost> lines;
+  };
+  std::unordered_map<uint32_t, FunctionLines> functions;
+  uint64_t total = 0;
+
+  for (Shard &shard : shards) {
+    for (auto &p : shard.process_ips) {
+      pid_t pid = p.first;
+      p.second.ForEach([&](uint64_t ip, uint64_t cycles) {
+        FunctionLines &function = functions[ResolveSymbol(pid, ip)];
+        function.cycles += cycles;
+        total += cycles;
+
+        unsigned line;
+        uintptr_t link_address;
+        const char *file = address_to_line(address_spaces[pid],
+                                           reinterpret_cast<void *>(ip), &line,
+                                           &link_address);
+        if (file == NULL) return;
+        LineCost &cost =
+            function.lines[std::string(file) + ":" + std::to_string(line)];
+        cost.cycles += cycles;
+        cost.instructions[link_address] += cycles;
+      });
+    }
+  }
+
+  // Hottest first, at each level
+  auto by_cycles = [](const std::pair<std::string, uint64_t> &a,
+                      const std::pair<std::string, uint64_t> &b) {
+    return a.second > b.second;
+  };
+  std::vector<uint32_t> hot_functions;
+  for (auto &f : functions) {
+    if (f.second.cycles * 100 >= total && !f.second.lines.empty()) {
+      hot_functions.push_back(f.first);
+    }
+  }
+  std::sort(hot_functions.begin(), hot_functions.end(),
+            [&](uint32_t a, uint32_t b) {
+              return functions[a].cycles > functions[b].cycles;
+            });
+
+  const char *unit = EventUnit(options.event);
+  std::cout << "\nHottest lines:" << std::endl;
+  for (uint32_t key : hot_functions) {
+    FunctionLines &function = functions[key];
+    std::cout << "  " << symbol_names.Name(key) << ": " << function.cycles
+              << " " << unit << std::endl;
+
+    std::vector<std::pair<std::string, uint64_t>> lines;
+    for (auto &l : function.lines) lines.push_back({l.first, l.second.cycles});
+    std::sort(lines.begin(), lines.end(), by_cycles);
+    if (lines.size() > 10) lines.resize(10);
+
+    for (auto &l : lines) {
+      std::cout << "    " << l.first << ": " << l.second << " " << unit << " "
+                << static_cast<double>(l.second) / function.cycles * 100 << "%"
+                << std::endl;
+
+      std::vector<std::pair<uintptr_t, uint64_t>> instructions(
+          function.lines[l.first].instructions.begin(),
+          function.lines[l.first].instructions.end());
+      std::sort(instructions.begin(), instructions.end(),
+                [](const std::pair<uintptr_t, uint64_t> &a,
+                   const std::pair<uintptr_t, uint64_t> &b) {
+                  return a.second > b.second;
+                });
+      if (instructions.size() > 3) instructions.resize(3);
+      for (auto &i : instructions) {
+        std::cout << "      0x" << std::hex << i.first << std::dec << ": "
+                  << i.second << " " << unit << std::endl;
+      }
+    }
+  }
+}
+
+// Print how long every thread ran, waited for a CPU, and blocked, with the
+// call paths it blocked in the longest
+void PrintOffCpu() {
+  for (Shard &shard : shards) {
+    for (auto &t : shard.off_cpu) off_cpu_threads[t.first] = std::move(t.second);
+    shard.off_cpu.clear();
+  }
+
+  std::cout << "\nOff-CPU time:" << std::endl;
+  for (auto &t : off_cpu_threads) {
+    OffCpuThread &thread = t.second;
+    uint64_t total = thread.on_cpu + thread.blocked + thread.preempted;
+    if (total == 0) continue;
+    std::cout << "  Thread " << t.first << ": " << thread.on_cpu / 1e6
+              << " ms on CPU, " << thread.blocked / 1e6 << " ms blocked ("
+              << 100.0 * thread.blocked / total << "%), "
+              << thread.preempted / 1e6 << " ms preempted" << std::endl;
+
+    // Every call path that blocked, longest first
+    CallingContextTree sites = thread.sites.Remap([&](uint64_t ip) -> uint64_t {
+      return ResolveSymbol(thread.pid, ip);
+    });
+    const std::vector<CallingContextTree::Node> &nodes = sites.nodes();
+    std::vector<uint32_t> paths;
+    for (uint32_t n = 0; n < nodes.size(); n++) {
+      if (n != CallingContextTree::kRoot && nodes[n].count != 0) {
+        paths.push_back(n);
+      }
+    }
+    std::sort(paths.begin(), paths.end(), [&](uint32_t a, uint32_t b) {
+      return nodes[a].count > nodes[b].count;
+    });
+    if (paths.size() > 5) paths.resize(5);
+
+    for (uint32_t n : paths) {
+      std::string path;
+      for (uint32_t p = n; p != CallingContextTree::kRoot; p = nodes[p].parent) {
+        path = symbol_names.Name(nodes[p].key) + (path.empty() ? "" : ";") +
+               path;
+      }
+      std::cout << "    " << nodes[n].count / 1e6 << " ms "
+                << 100.0 * nodes[n].count / thread.blocked << "%: " << path
+                << std::endl;
+    }
+  }
+}
+
+// Print where the page faults of every thread happened, and which code
+// first touched the pages of every mapping
+void PrintPageFaults() {
+  PageFaults faults;
+  for (Shard &shard : shards) faults.Merge(shard.page_faults);
+  if (faults.empty()) {
+    std::cout << "\nPage faults: none" << std::endl;
+    return;
+  }
+
+  // Data mappings first, since code is mapped too and faults on it
+  auto mapping_of = [](pid_t pid, uint64_t addr) -> std::string {
+    const Mapping *m = data_spaces[pid].FindMapping(addr);
+    if (m == NULL) m = address_spaces[pid].FindMapping(addr);
+    if (m == NULL) return "unknown mapping";
+    std::ostringstream name;
+    name << m->filename << " " << std::hex << "0x" << m->start << "-0x"
+         << m->end;
+    return name.str();
+  };
+  auto function_of = [](pid_t pid, uint64_t ip) -> std::string {
+    return symbol_names.Name(ResolveSymbol(pid, ip));
+  };
+  faults.Print(std::cout, CpuNodes(), mapping_of, function_of, thread_names);
+}
+
+// Add the timed samples and thread lifetimes of every shard to timeline
+void FillTimeline(Timeline &timeline) {
+  for (Shard &shard : shards) {
+    for (const TimedSample &s : shard.timed_samples) {
+      timeline.AddSample(s.pid, s.tid, s.time, ResolveSymbol(s.pid, s.ip),
+                         s.weight);
+    }
+    for (auto &t : shard.thread_starts) timeline.SetStart(t.first, t.second);
+    for (auto &t : shard.thread_ends) timeline.SetEnd(t.first, t.second);
+  }
+}
+
+// Bucket the timed samples of every shard into time slices, and write them
+// as a Chrome trace
+void WriteTimeline() {
+  Timeline timeline(static_cast<uint64_t>(options.time_slice * 1000000));
+  FillTimeline(timeline);
+
+  std::ofstream out(options.timeline_file);
+  PREFER(out) << "Failed to open " << options.timeline_file;
+  timeline.WriteChromeTrace(out, symbol_names, EventUnit(options.event));
+}
+
+// Print how evenly the threads shared the work and how much they overlapped.
+// A thread counts as running in a slice if it has a sample there, so the
+// slices must be long enough that a running thread nearly always does: twice
+// the median gap between consecutive samples of a thread, and at least
+// --time-slice. The gaps of all threads are pooled, so a thread that mostly
+// blocked, with a few samples far apart, cannot stretch the slice to the
+// whole run.
+void PrintScalability() {
+  std::unordered_map<pid_t, std::vector<uint64_t>> times;
+  for (Shard &shard : shards) {
+    for (const TimedSample &s : shard.timed_samples) {
+      times[s.tid].push_back(s.time);
+    }
+  }
+  std::vector<uint64_t> gaps;
+  for (auto &t : times) {
+    std::vector<uint64_t> &thread_times = t.second;
+    std::sort(thread_times.begin(), thread_times.end());
+    for (size_t i = 1; i < thread_times.size(); i++) {
+      gaps.push_back(thread_times[i] - thread_times[i - 1]);
+    }
+  }
+  uint64_t slice = static_cast<uint64_t>(options.time_slice * 1000000);
+  if (!gaps.empty()) {
+    std::nth_element(gaps.begin(), gaps.begin() + gaps.size() / 2, gaps.end());
+    slice = std::max(slice, 2 * gaps[gaps.size() / 2]);
+  }
+
+  Timeline timeline(slice);
+  FillTimeline(timeline);
+  timeline.PrintScalability(std::cout, symbol_names);
+}
+
+// Redraw the live view, and age its samples
+void RefreshLiveTop() {
+  uint64_t expirations;
+  REQUIRE(read(refresh_fd, &expirations, sizeof(expirations)) ==
+          sizeof(expirations))
+      << "read failed: " << strerror(errno);
+
+  // Draw over the previous view on a terminal, and below it otherwise
+  if (isatty(STDOUT_FILENO)) std::cout << "\033[H\033[2J";
+  live_top.Print(std::cout, symbol_names, TOP_THREADS, TOP_FUNCTIONS,
+                 EventUnit(options.event));
+  std::cout << std::endl;
+  live_top.Decay();
+}
+
+// Return true if fd is still an event of shard. An event closed while
+// handling an earlier one, such as a thread's companion events at its exit,
+// may have its fd reused at once by an event of another shard, which must
+// not be read from here.
+bool ShardOwns(Shard &shard, int fd) {
+  std::lock_guard<std::mutex> guard(perf_libs_lock);
+  return shard.perf_fds.count(fd) != 0;
+}
+
+// Make the wakeup tick of shard fire every tick_ns from now on
+void SetTick(Shard &shard, uint64_t tick_ns) {
+  itimerspec interval;
+  memset(&interval, 0, sizeof(interval));
+  interval.it_interval.tv_sec = tick_ns / 1000000000;
+  interval.it_interval.tv_nsec = tick_ns % 1000000000;
+  interval.it_value = interval.it_interval;
+  REQUIRE(timerfd_settime(shard.tick_fd, /*flags=*/0, &interval, NULL) != -1)
+      << "timerfd_settime failed: " << strerror(errno);
+  shard.tick_ns = tick_ns;
+}
+
+// Read every buffer of shard, as its wakeup tick fired. With the adaptive
+// policy, tick sooner if a buffer got close to full since the last tick,
+// and later if all stayed nearly empty.
+// Return true if the last thread of the target has exited
+bool DrainShard(Shard &shard) {
+  uint64_t expirations;
+  REQUIRE(read(shard.tick_fd, &expirations, sizeof(expirations)) ==
+          sizeof(expirations))
+      << "read failed: " << strerror(errno);
+
+  std::vector<int> fds;
+  {
+    std::lock_guard<std::mutex> guard(perf_libs_lock);
+    fds.assign(shard.perf_fds.begin(), shard.perf_fds.end());
+  }
+  bool target_exited = false;
+  for (int fd : fds) {
+    // An fd closed while draining an earlier one may already have been
+    // reused by another shard
+    if (!ShardOwns(shard, fd)) continue;
+    if (HandleRecord(shard, fd)) target_exited = true;
+  }
+
+  if (options.wakeup == WAKEUP_ADAPTIVE) {
+    uint64_t tick_ns = shard.tick_ns;
+    if (shard.max_fill > ADAPTIVE_HIGH_FILL) {
+      tick_ns = std::max<uint64_t>(tick_ns / 2, ADAPTIVE_MIN_TICK_MS * 1000000);
+    } else if (shard.max_fill < ADAPTIVE_LOW_FILL) {
+      tick_ns = std::min<uint64_t>(tick_ns * 2, ADAPTIVE_MAX_TICK_MS * 1000000);
+    }
+    if (tick_ns != shard.tick_ns) SetTick(shard, tick_ns);
+  }
+  shard.max_fill = 0;
+  return target_exited;
+}
+
+// Drain the perf fds of one shard until the main child exits
+void RunCollector(Shard &shard) {
   bool running = true;
   epoll_event ev_list[MAX_EPOLL_EVENTS];
+  SelfStats *stats = StatsOf(shard);
   while (running) {
     memset(ev_list, 0, sizeof(epoll_event) * MAX_EPOLL_EVENTS);
+    uint64_t wait_start = stats != NULL ? MonotonicNs() : 0;
     int ready_num =
-        epoll_wait(epoll_fd, ev_list, MAX_EPOLL_EVENTS, /*timeout=*/-1);
+        epoll_wait(shard.epoll_fd, ev_list, MAX_EPOLL_EVENTS, /*timeout=*/-1);
+    if (ready_num == -1 && errno == EINTR) continue;
     REQUIRE(ready_num != -1) << "epoll_wait failed: " << strerror(errno);
+    uint64_t wakeup_start = stats != NULL ? MonotonicNs() : 0;
+    if (stats != NULL) stats->waits.Add(wakeup_start - wait_start);
 
     for (int i = 0; i < ready_num; ++i) {
-      if (HandleRecord(ev_list[i].data.fd)) {
+      int fd = ev_list[i].data.fd;
+      if (fd == stop_fd) {
+        // Another shard saw the main child exit
+        running = false;
+      } else if (fd == refresh_fd) {
+        RefreshLiveTop();
+      } else if (fd != timer_fd && fd != signal_fd && fd != shard.tick_fd &&
+                 !ShardOwns(shard, fd)) {
+        // Closed earlier in this batch
+        continue;
+      } else if (fd == timer_fd || fd == signal_fd ||
+                 (fd == shard.tick_fd ? DrainShard(shard)
+                                      : HandleRecord(shard, fd))) {
+        // Tell every other shard to stop too
+        uint64_t one = 1;
+        REQUIRE(write(stop_fd, &one, sizeof(one)) == sizeof(one))
+            << "write failed: " << strerror(errno);
         running = false;
       }
     }
+    if (stats != NULL) {
+      stats->wakeups.Add(MonotonicNs() - wakeup_start);
+      stats->ready_fds += ready_num;
+    }
+  }
+}
+
+// Print what the profiler itself cost while collecting for wall_ns, having
+// used the CPU time in usage by then (--self-stats)
+void PrintSelfStats(uint64_t wall_ns, const rusage &usage) {
+  SelfStats stats;
+  uint64_t lost = 0;
+  for (Shard &shard : shards) {
+    stats.Merge(shard.stats);
+    for (auto &l : shard.thread_lost) lost += l.second;
+    for (auto &l : shard.cpu_lost) lost += l.second;
+  }
+  std::cout << std::endl;
+  stats.Print(std::cout, lost);
+
+  double user_ms = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3;
+  double system_ms =
+      usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+  std::cout << "  profiler CPU time: " << user_ms << " ms user, " << system_ms
+            << " ms system, over " << wall_ns / 1e6 << " ms ("
+            << 100 * (user_ms + system_ms) / (wall_ns / 1e6) << "% of a CPU)"
+            << std::endl;
+}
+
+// Move the raw samples of every shard into thread_ips
+void MergeShards() {
+  for (Shard &shard : shards) {
+    for (auto &t : shard.thread_ips) {
+      auto it = thread_ips.find(t.first);
+      if (it == thread_ips.end()) {
+        thread_ips.insert({t.first, std::move(t.second)});
+      } else {
+        IpHistogram &merged = it->second.ips;
+        t.second.ips.ForEach(
+            [&](uint64_t ip, uint64_t count) { merged.Add(ip, count); });
+        it->second.stacks.Merge(t.second.stacks);
+        for (auto &c : t.second.counters) {
+          it->second.counters[c.first].Add(c.second);
+        }
+      }
+    }
+    shard.thread_ips.clear();
+    shard.last_key = UINT64_MAX;
+  }
+}
+
+// Resolve whatever is still unresolved, and print the report of all samples
+void PrintReport() {
+  if (options.deferred) {
+    MergeShards();
+    SymbolizeDeferredSamples();
+  }
+
+  // Add up the records lost by every shard
+  std::unordered_map<pid_t, uint64_t> thread_lost;
+  std::map<int, uint64_t> cpu_lost;
+  uint64_t lost_count = 0;
+  for (Shard &shard : shards) {
+    for (auto &l : shard.thread_lost) {
+      thread_lost[l.first] += l.second;
+      lost_count += l.second;
+    }
+    for (auto &l : shard.cpu_lost) {
+      cpu_lost[l.first] += l.second;
+      lost_count += l.second;
+    }
   }
 
   // Print the count of events from perf_event
   printf("\nProfiler Output:\n");
 
-  // Loop through every thread
-  for (auto p : thread_mapping) {
-    std::cout << "  Thread " << p.first << ":" << std::endl;
-    size_t total_count = thread_sample_count[p.first];
-
-    // Sort the function-to-count mapping by its value (count)
-    // Since the two functions can possibly have the same sample count (very
-    // unlikely in large programs), we use multimap instead of map here
-    std::multimap<size_t, std::string, std::greater<size_t>> dst;
-    std::transform(
-        p.second.begin(), p.second.end(), std::inserter(dst, dst.begin()),
-        [](const std::pair<std::string, size_t> &tmp) {
-          return std::pair<size_t, std::string>(tmp.second, tmp.first);
-        });
-
-    for (const auto &q : dst) {
-      std::cout << "    " << q.second << ": " << q.first * SAMPLE_PERIOD
-                << " cycles "
-                << static_cast<double>(q.first) / total_count * 100 << "%"
+  // Counts are in the unit of the sampled event
+  const char *unit = EventUnit(options.event);
+
+  // Group the threads by process, each process under the name it ran as
+  std::map<pid_t, std::vector<pid_t>> processes;
+  for (auto &p : thread_mapping) {
+    processes[ProcessOf(p.first)].push_back(p.first);
+  }
+
+  for (auto &process : processes) {
+    pid_t pid = process.first;
+    std::vector<pid_t> &tids = process.second;
+    std::sort(tids.begin(), tids.end());
+    size_t process_count = 0;
+    for (pid_t tid : tids) process_count += thread_sample_count[tid];
+    std::cout << "Process " << pid;
+    auto name = thread_names.find(pid);
+    if (name != thread_names.end()) std::cout << " (" << name->second << ")";
+    std::cout << ": " << process_count << " " << unit << " "
+              << static_cast<double>(process_count) / sample_count * 100 << "%"
+              << std::endl;
+
+    // Loop through every thread of the process
+    for (pid_t tid : tids) {
+      std::cout << "  Thread " << tid << ":" << std::endl;
+      size_t total_count = thread_sample_count[tid];
+      const function_freq_t &functions = thread_mapping[tid];
+
+      // Sort the function-to-count mapping by its value (count)
+      // Since the two functions can possibly have the same sample count (very
+      // unlikely in large programs), we use multimap instead of map here
+      std::multimap<size_t, std::string, std::greater<size_t>> dst;
+      std::transform(
+          functions.begin(), functions.end(), std::inserter(dst, dst.begin()),
+          [](const std::pair<std::string, size_t> &tmp) {
+            return std::pair<size_t, std::string>(tmp.second, tmp.first);
+          });
+
+      if (options.event.callchain) {
+        PrintCallGraphCosts(thread_cct[tid], total_count,
+                            thread_counters[tid]);
+      } else {
+        for (const auto &q : dst) {
+          std::cout << "    " << q.second << ": " << q.first << " " << unit
+                    << " "
+                    << static_cast<double>(q.first) / total_count * 100 << "%";
+          if (options.event.counters) {
+            std::cout << CounterRates(thread_counters[tid][q.second]);
+          }
+          std::cout << std::endl;
+        }
+      }
+      if (thread_lost[tid] != 0) {
+        std::cout << "    (lost " << thread_lost[tid] << " records)"
+                  << std::endl;
+      }
+    }
+  }
+  // The clocks count time already
+  std::cout << "Total: " << sample_count << " " << unit << " (";
+  if (strcmp(unit, "ns") == 0) std::cout << sample_count / 1e9 << " s of ";
+  std::cout << EventName(options.event) << ")" << std::endl;
+
+  if (lost_count != 0) {
+    for (auto &l : cpu_lost) {
+      std::cout << "Lost on CPU " << l.first << ": " << l.second << " records"
                 << std::endl;
     }
+    std::cout << "Lost: " << lost_count
+              << " records (try a larger --mmap-pages)" << std::endl;
+  }
+
+  if (options.event.callchain) {
+    WriteCallGraphFiles();
+  }
+  if (!options.timeline_file.empty()) {
+    WriteTimeline();
+  }
+  if (options.scalability) {
+    PrintScalability();
+  }
+  if (options.annotate) {
+    PrintAnnotation();
+  }
+  if (options.off_cpu) {
+    PrintOffCpu();
+  }
+  if (options.page_faults) {
+    PrintPageFaults();
   }
-  std::cout << "Total: " << sample_count * SAMPLE_PERIOD << " cycles"
-            << std::endl;
 }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr,
-            "Usage: %s <command to run with profiler> [command arguments...]\n",
-            argv[0]);
+void RunProfiler() {
+  uint64_t start = MonotonicNs();
+
+  // Shard 0 runs on this thread
+  std::vector<std::thread> collectors;
+  for (size_t i = 1; i < shards.size(); i++) {
+    collectors.emplace_back(RunCollector, std::ref(shards[i]));
+  }
+  RunCollector(shards[0]);
+  for (auto &c : collectors) c.join();
+
+  // Threads may still be running if the profiling window ended first. Stop
+  // their events so the buffers can be drained for the last time.
+  for (auto &p : perf_libs) p.second.StopSampling();
+  for (PerfLib &p : redirected_events) p.StopSampling();
+
+  // Samples of other threads (or, in per-CPU mode, on other CPUs) may still
+  // be waiting in their buffers after the main child's exit record was read.
+  // Each buffer is drained through the shard that owns it, whose epoll set
+  // an exit record removes it from.
+  for (Shard &shard : shards) {
+    std::vector<int> remaining(shard.perf_fds.begin(), shard.perf_fds.end());
+    for (int fd : remaining) HandleRecord(shard, fd);
+  }
+
+  // Detach from whatever is still running
+  for (auto &p : perf_libs) p.second.Close();
+  for (PerfLib &p : redirected_events) p.Close();
+  perf_libs.clear();
+  redirected_events.clear();
+
+  // What collecting cost, before reporting adds to it
+  uint64_t wall_ns = MonotonicNs() - start;
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  if (!options.record_file.empty()) {
+    for (Shard &shard : shards) shard.record_buffer.Flush(recording);
+    recording.Close();
+    std::cout << "Recorded " << recording.size() << " bytes to "
+              << options.record_file << std::endl;
+  } else {
+    PrintReport();
+  }
+  if (options.self_stats) PrintSelfStats(wall_ns, usage);
+}
+
+// Replay the recording at path through the same code that handles live
+// records, and return the number of samples in it
+uint64_t ReplayRecording(const std::string &path) {
+  RecordingReader reader;
+  REQUIRE(reader.Open(path)) << "Failed to read recording " << path;
+
+  // The recorded events decide which fields the samples have
+  const RecordingHeader &header = reader.header();
+  uint64_t optional =
+      PERF_SAMPLE_TIME | PERF_SAMPLE_CALLCHAIN | PERF_SAMPLE_READ;
+  REQUIRE((header.sample_type & ~optional) == SAMPLE_TYPE)
+      << path << " was recorded with other event settings";
+  options.event.type = header.event_type;
+  options.event.config = header.event_config;
+  options.event.callchain = header.sample_type & PERF_SAMPLE_CALLCHAIN;
+  options.event.counters = header.sample_type & PERF_SAMPLE_READ;
+  options.event.time = header.sample_type & PERF_SAMPLE_TIME;
+  options.off_cpu = header.flags & RECORDING_OFF_CPU;
+  options.page_faults = header.flags & RECORDING_PAGE_FAULTS;
+  REQUIRE(!KeepTimes() || options.event.time)
+      << path << " was recorded without timestamps";
+  child_pid = header.child_pid;
+
+  Shard &shard = shards[0];
+  uint64_t samples = 0;
+  const perf_event_header *record;
+  while ((record = reader.NextRecord()) != NULL) {
+    if (record->type == PERF_RECORD_SAMPLE) samples++;
+    if (record->type == RECORD_LOST_SOURCE) {
+      const LostSourceRecord *source =
+          reinterpret_cast<const LostSourceRecord *>(record);
+      if (source->cpu != -1) {
+        shard.cpu_lost[source->cpu] += source->lost;
+      } else {
+        shard.thread_lost[source->tid] += source->lost;
+      }
+      continue;
+    }
+    ProcessRecord(shard, /*perf_lib=*/NULL, record->type, record->misc,
+                  const_cast<perf_event_header *>(record + 1));
+  }
+  return samples;
+}
+
+// Print the report of a recording
+void RunReport() {
+  ReplayRecording(options.report_file);
+  PrintReport();
+}
+
+// Read a recording or folded stacks at path into profile. Threads are
+// grouped into roles by name, with the main thread of the target apart.
+void ReadProfile(const std::string &path, Profile *profile) {
+  RecordingReader reader;
+  if (!reader.Open(path)) {
+    REQUIRE(ReadFoldedProfile(path, profile))
+        << path << " is neither a recording nor folded stacks";
+    return;
+  }
+
+  // Start from nothing; ids of threads and processes mean nothing across
+  // recordings
+  thread_mapping.clear();
+  thread_sample_count.clear();
+  sample_count = 0;
+  samples_taken = 0;
+  thread_names.clear();
+  thread_processes.clear();
+  thread_cct.clear();
+  thread_counters.clear();
+  address_spaces.clear();
+  data_spaces.clear();
+  ip_symbols.clear();
+  retired_spaces.clear();
+  shards.clear();
+  shards.resize(1);
+
+  profile->samples = ReplayRecording(path);
+  profile->unit = EventUnit(options.event);
+  if (options.deferred) {
+    MergeShards();
+    SymbolizeDeferredSamples();
+  }
+
+  for (auto &t : thread_mapping) {
+    pid_t tid = t.first;
+    auto name = thread_names.find(tid);
+    std::string role = name == thread_names.end() ? "thread" : name->second;
+    if (ProcessOf(tid) == tid) role += " (main)";
+    for (auto &f : t.second) profile->roles[role][f.first] += f.second;
+  }
+}
+
+// Compare the run in the file options.diff_file against the one in path, and
+// return the exit status: 2 if a function regressed by more than --fail-above
+int RunDiff(const std::string &path) {
+  Profile base;
+  Profile next;
+  ReadProfile(options.diff_file, &base);
+  ReadProfile(path, &next);
+  REQUIRE(base.unit == next.unit || options.diff_by == DIFF_BY_SHARE)
+      << "Absolute counts of " << options.diff_file << " and " << path
+      << " are in " << base.unit << " and " << next.unit;
+  bool regressed = PrintDiff(std::cout, base, next, options.diff_by,
+                             options.fail_above);
+  return regressed ? 2 : 0;
+}
+
+void PrintUsage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options] <command to run with profiler> [command "
+          "arguments...]\n"
+          "       %s [options] -p <pid>\n"
+          "       %s --diff <base> [options] <next>\n"
+          "Options:\n"
+          "  -p, --pid <pid>  profile the running process pid, with all its "
+          "threads, until\n"
+          "                   it exits or the profiler is interrupted\n"
+          "  -D, --duration <seconds>\n"
+          "                   stop profiling after this long; the process "
+          "keeps running\n"
+          "  -d, --deferred   count raw instruction pointers while the target "
+          "runs and\n"
+          "                   resolve function names once it has exited\n"
+          "  -j, --jobs <n>   number of threads used to resolve names in "
+          "deferred mode\n"
+          "  -t, --collectors <n>\n"
+          "                   number of threads draining the perf buffers; "
+          "more than one\n"
+          "                   implies --deferred\n"
+          "  --per-cpu        open one inherited event per online CPU instead "
+          "of one per\n"
+          "                   thread, so short-lived threads are not missed\n"
+          "  -e, --event <event>\n"
+          "                   sample this event instead of ref-cycles: a perf "
+          "name like\n"
+          "                   cycles, instructions or task-clock, "
+          "<type>:<config>, or a\n"
+          "                   tracepoint <subsystem>:<name>. Without hardware "
+          "counters,\n"
+          "                   cycles are replaced with task-clock (cpu-clock "
+          "with --per-cpu)\n"
+          "  -P, --period <n> take a sample every this many events: cycles, "
+          "ns for the\n"
+          "                   clocks (default %d; 1 for tracepoints and other "
+          "software\n"
+          "                   events)\n"
+          "  -F, --freq <hz>  take about this many samples per second and "
+          "thread\n"
+          "                   instead, however fast the thread runs\n"
+          "  -m, --mmap-pages <n>\n"
+          "                   size of each ring buffer in pages, a power of "
+          "two\n"
+          "                   (default %d)\n"
+          "  -g, --call-graph record call stacks and report inclusive as well "
+          "as\n"
+          "                   exclusive cycles per function\n"
+          "  --folded <file>  write folded stacks (thread;caller;callee "
+          "count) for flame\n"
+          "                   graph tools; implies --call-graph\n"
+          "  --folded-process <file>\n"
+          "                   same, with the stacks of all threads merged\n"
+          "  --flamegraph <file>\n"
+          "                   write an SVG flame graph of all threads; implies "
+          "--call-graph\n"
+          "  -c, --counters   also count instructions, cache misses and branch "
+          "misses,\n"
+          "                   and report IPC and miss rates per function; not "
+          "with\n"
+          "                   --per-cpu\n"
+          "  --timeline <file>\n"
+          "                   write the hottest function of every thread in "
+          "every time\n"
+          "                   slice as a Chrome trace (chrome://tracing, "
+          "Perfetto)\n"
+          "  --time-slice <ms>\n"
+          "                   length of a timeline slice (default 1)\n"
+          "  --scalability    also report the load imbalance, concurrency and "
+          "serial\n"
+          "                   fraction of the threads, and the speedup they "
+          "allow\n"
+          "  --annotate       also report the hottest source lines of every "
+          "function with\n"
+          "                   at least 1%% of the cycles, and their hottest "
+          "instructions\n"
+          "  --off-cpu        also report the time each thread spends off the "
+          "CPU, and\n"
+          "                   the call paths it blocks in; not with --per-cpu\n"
+          "  --page-faults    also sample every page fault, and report faults "
+          "by thread,\n"
+          "                   CPU and NUMA node, and which code first touched "
+          "the pages\n"
+          "                   of every mapping; not with --per-cpu\n"
+          "  --record <file>  write the raw records of the run to file instead "
+          "of\n"
+          "                   printing a report\n"
+          "  --report <file>  print the report of a recording instead of "
+          "running a\n"
+          "                   command\n"
+          "  --top <s>        every s seconds, show the hottest functions of "
+          "the last\n"
+          "                   few seconds, overall and of the hottest "
+          "threads; not with\n"
+          "                   --deferred, --collectors, --record or --report\n"
+          "  --diff <base> <next>\n"
+          "                   compare two runs, each a recording or folded "
+          "stacks, and\n"
+          "                   print the functions and thread roles that "
+          "changed most\n"
+          "  --diff-by <share|cycles>\n"
+          "                   compare shares of each run's cycles (default), "
+          "or absolute\n"
+          "                   cycles of runs of the same work\n"
+          "  --fail-above <percent>\n"
+          "                   with --diff, exit with 2 if a function got "
+          "significantly\n"
+          "                   slower by more than percent of the base run\n"
+          "  --self-stats     also report what the profiler itself cost: "
+          "latencies of\n"
+          "                   wakeups, records and symbol lookups, ring "
+          "buffer fill,\n"
+          "                   lost records and CPU time\n"
+          "  --wakeup <policy>\n"
+          "                   when collectors read the ring buffers: record "
+          "(default, at\n"
+          "                   every record), bytes[:<n>] (once n bytes wait, "
+          "default a\n"
+          "                   quarter of the buffer), events:<n> (every n "
+          "samples),\n"
+          "                   tick[:<ms>] (drain all every ms, default %d), or "
+          "adaptive\n"
+          "                   (a tick that shortens as buffers fill up)\n",
+          name, name, name, SAMPLE_PERIOD, NUM_DATA_PAGES, WAKEUP_TICK_MS);
+}
+
+// Values of options that only have a long form
+enum {
+  OPT_PER_CPU = 256,
+  OPT_FOLDED,
+  OPT_FOLDED_PROCESS,
+  OPT_FLAMEGRAPH,
+  OPT_TIMELINE,
+  OPT_TIME_SLICE,
+  OPT_SCALABILITY,
+  OPT_ANNOTATE,
+  OPT_OFF_CPU,
+  OPT_PAGE_FAULTS,
+  OPT_RECORD,
+  OPT_REPORT,
+  OPT_TOP,
+  OPT_DIFF,
+  OPT_DIFF_BY,
+  OPT_FAIL_ABOVE,
+  OPT_SELF_STATS,
+  OPT_WAKEUP,
+};
+
+// Parse the options in front of the command, and return the index of the
+// command in argv
+int ParseOptions(int argc, char **argv) {
+  static const struct option long_options[] = {
+      {"pid", required_argument, NULL, 'p'},
+      {"duration", required_argument, NULL, 'D'},
+      {"deferred", no_argument, NULL, 'd'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"collectors", required_argument, NULL, 't'},
+      {"per-cpu", no_argument, NULL, OPT_PER_CPU},
+      {"event", required_argument, NULL, 'e'},
+      {"period", required_argument, NULL, 'P'},
+      {"freq", required_argument, NULL, 'F'},
+      {"mmap-pages", required_argument, NULL, 'm'},
+      {"call-graph", no_argument, NULL, 'g'},
+      {"counters", no_argument, NULL, 'c'},
+      {"folded", required_argument, NULL, OPT_FOLDED},
+      {"folded-process", required_argument, NULL, OPT_FOLDED_PROCESS},
+      {"flamegraph", required_argument, NULL, OPT_FLAMEGRAPH},
+      {"timeline", required_argument, NULL, OPT_TIMELINE},
+      {"time-slice", required_argument, NULL, OPT_TIME_SLICE},
+      {"scalability", no_argument, NULL, OPT_SCALABILITY},
+      {"annotate", no_argument, NULL, OPT_ANNOTATE},
+      {"off-cpu", no_argument, NULL, OPT_OFF_CPU},
+      {"page-faults", no_argument, NULL, OPT_PAGE_FAULTS},
+      {"record", required_argument, NULL, OPT_RECORD},
+      {"report", required_argument, NULL, OPT_REPORT},
+      {"top", required_argument, NULL, OPT_TOP},
+      {"diff", required_argument, NULL, OPT_DIFF},
+      {"diff-by", required_argument, NULL, OPT_DIFF_BY},
+      {"fail-above", required_argument, NULL, OPT_FAIL_ABOVE},
+      {"self-stats", no_argument, NULL, OPT_SELF_STATS},
+      {"wakeup", required_argument, NULL, OPT_WAKEUP},
+      {NULL, 0, NULL, 0},
+  };
+
+  bool period_given = false;
+  int c;
+  // The leading '+' stops parsing at the first non-option, so the options of
+  // the profiled command are left alone
+  while ((c = getopt_long(argc, argv, "+p:D:dj:t:e:P:F:m:gc", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'p':
+        options.attach_pid = strtol(optarg, NULL, 10);
+        break;
+      case 'D':
+        options.duration = strtod(optarg, NULL);
+        break;
+      case 'd':
+        options.deferred = true;
+        break;
+      case 'j':
+        options.symbolize_jobs = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        options.collectors = strtoul(optarg, NULL, 10);
+        break;
+      case OPT_PER_CPU:
+        options.per_cpu = true;
+        options.event.inherit = true;
+        break;
+      case 'e':
+        if (!ParseEventSpec(optarg, &options.event)) {
+          fprintf(stderr, "Unknown event %s\n", optarg);
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 'P':
+        options.event.period = strtoull(optarg, NULL, 10);
+        period_given = true;
+        break;
+      case 'F':
+        options.event.frequency = strtoull(optarg, NULL, 10);
+        period_given = true;
+        break;
+      case 'm':
+        options.event.data_pages = strtoul(optarg, NULL, 10);
+        break;
+      case 'g':
+        options.event.callchain = true;
+        break;
+      case 'c':
+        options.event.counters = true;
+        break;
+      case OPT_FOLDED:
+        options.folded_file = optarg;
+        options.event.callchain = true;
+        break;
+      case OPT_FOLDED_PROCESS:
+        options.folded_process_file = optarg;
+        options.event.callchain = true;
+        break;
+      case OPT_FLAMEGRAPH:
+        options.flamegraph_file = optarg;
+        options.event.callchain = true;
+        break;
+      case OPT_TIMELINE:
+        options.timeline_file = optarg;
+        options.event.time = true;
+        break;
+      case OPT_TIME_SLICE:
+        options.time_slice = strtod(optarg, NULL);
+        break;
+      case OPT_SCALABILITY:
+        options.scalability = true;
+        options.event.time = true;
+        break;
+      case OPT_ANNOTATE:
+        options.annotate = true;
+        break;
+      case OPT_OFF_CPU:
+        options.off_cpu = true;
+        break;
+      case OPT_PAGE_FAULTS:
+        options.page_faults = true;
+        break;
+      case OPT_RECORD:
+        options.record_file = optarg;
+        // A recording can always be shown as a timeline later
+        options.event.time = true;
+        break;
+      case OPT_REPORT:
+        options.report_file = optarg;
+        break;
+      case OPT_TOP:
+        options.top = strtod(optarg, NULL);
+        break;
+      case OPT_DIFF:
+        options.diff_file = optarg;
+        break;
+      case OPT_DIFF_BY:
+        if (strcmp(optarg, "share") == 0) {
+          options.diff_by = DIFF_BY_SHARE;
+        } else if (strcmp(optarg, "cycles") == 0) {
+          options.diff_by = DIFF_BY_CYCLES;
+        } else {
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        break;
+      case OPT_FAIL_ABOVE:
+        options.fail_above = strtod(optarg, NULL);
+        break;
+      case OPT_SELF_STATS:
+        options.self_stats = true;
+        break;
+      case OPT_WAKEUP: {
+        // The name of the policy, then for some ":<value>"
+        std::string policy = optarg;
+        size_t colon = policy.find(':');
+        if (colon != std::string::npos) {
+          options.wakeup_value = strtoull(optarg + colon + 1, NULL, 10);
+          policy.resize(colon);
+        }
+        if (policy == "record") {
+          options.wakeup = WAKEUP_RECORD;
+        } else if (policy == "bytes") {
+          options.wakeup = WAKEUP_BYTES;
+        } else if (policy == "events") {
+          options.wakeup = WAKEUP_EVENTS;
+        } else if (policy == "tick") {
+          options.wakeup = WAKEUP_TICK;
+        } else if (policy == "adaptive") {
+          options.wakeup = WAKEUP_ADAPTIVE;
+        } else {
+          PrintUsage(argv[0]);
+          exit(1);
+        }
+        break;
+      }
+      default:
+        PrintUsage(argv[0]);
+        exit(1);
+    }
+  }
+
+  // Tracepoints and software events other than the clocks come far less
+  // often than cycles, so unless told otherwise every one is sampled.
+  // Tracepoints fire in the kernel, and only their user callchains tell
+  // which code got there.
+  bool tracepoint = options.event.type == PERF_TYPE_TRACEPOINT;
+  bool clock = strcmp(EventUnit(options.event), "ns") == 0;
+  if (!period_given &&
+      (tracepoint || (options.event.type == PERF_TYPE_SOFTWARE && !clock))) {
+    options.event.period = 1;
+  }
+  if (tracepoint) options.event.callchain = true;
+
+  // The ring buffer must be a power of two pages. Reports and attaching run
+  // no command, and a diff takes the next run in its place. Inherited events
+  // cannot read their group into samples, and the switches and page faults
+  // of a thread must each go to one buffer. Counters are rated per cycle.
+  size_t pages = options.event.data_pages;
+  bool report = !options.report_file.empty();
+  bool attach = options.attach_pid != 0;
+  bool diff = !options.diff_file.empty();
+  if ((optind >= argc) != (report || attach) || (report && attach) ||
+      (diff && (report || attach || optind + 1 != argc)) ||
+      (options.fail_above >= 0 && !diff) ||
+      options.attach_pid < 0 || options.duration < 0 ||
+      options.top < 0 || (options.top != 0 && options.top * 1e9 < 1) ||
+      (options.top != 0 && (options.deferred || options.collectors > 1 ||
+                            report || !options.record_file.empty())) ||
+      options.time_slice * 1000000 < 1 ||
+      options.collectors == 0 || options.event.period == 0 || pages == 0 ||
+      (options.per_cpu && (options.event.counters || options.off_cpu ||
+                           options.page_faults)) ||
+      (options.event.counters &&
+       strcmp(EventUnit(options.event), "cycles") != 0) ||
+      (pages & (pages - 1)) != 0 ||
+      ((options.wakeup == WAKEUP_RECORD ||
+        options.wakeup == WAKEUP_ADAPTIVE) && options.wakeup_value != 0) ||
+      (options.wakeup == WAKEUP_EVENTS && options.wakeup_value == 0) ||
+      (options.wakeup == WAKEUP_BYTES &&
+       options.wakeup_value >= pages * getpagesize())) {
+    PrintUsage(argv[0]);
     exit(1);
   }
 
-  // Initialize epoll
-  epoll_fd = epoll_create1(/*flags=*/0);
-  REQUIRE(epoll_fd != -1) << "epoll_create1 failed: " << strerror(errno);
+  // Buffers drained on a tick still wake their collector before they
+  // overflow
+  size_t buffer_bytes = pages * getpagesize();
+  switch (options.wakeup) {
+    case WAKEUP_RECORD:
+      break;
+    case WAKEUP_BYTES:
+      options.event.wakeup_bytes = options.wakeup_value != 0
+                                       ? options.wakeup_value
+                                       : buffer_bytes / 4;
+      break;
+    case WAKEUP_EVENTS:
+      options.event.wakeup_events = options.wakeup_value;
+      break;
+    case WAKEUP_TICK:
+    case WAKEUP_ADAPTIVE:
+      options.event.wakeup_bytes = buffer_bytes * WAKEUP_SAFETY_FILL;
+      break;
+  }
 
-  // Create a pipe so the parent can tell the child to exec
-  int pipefd[2];
-  REQUIRE(pipe(pipefd) == 0) << "pipe failed: " << strerror(errno);
+  // Samples are symbolized while collecting only with a single collector,
+  // which then owns the symbol tables alone
+  if (options.collectors > 1) {
+    options.deferred = true;
+  }
+  return optind;
+}
 
-  // Create a child process
-  child_pid = fork();
-  REQUIRE(child_pid != -1) << "fork failed: " << strerror(errno);
+// Open the events of every thread of the running process child_pid
+void AttachToProcess() {
+  // Threads may be created while we open events for the others, so look
+  // again until there are no new ones
+  std::unordered_map<pid_t, bool> seen;
+  bool found_new = true;
+  while (found_new) {
+    found_new = false;
+    for (pid_t tid : ProcessThreads(child_pid)) {
+      if (seen.insert({tid, true}).second) {
+        found_new = true;
+        TrackThread(child_pid, tid);
+        if (!OpenThreadEvents(tid, /*start=*/false)) {
+          INFO << "We missed the thread " << tid;
+          UntrackThread(tid);
+        }
+      }
+    }
+  }
+  REQUIRE(!seen.empty()) << "No process " << child_pid;
+}
 
-  if (child_pid == 0) {
-    // In child process. Read from the pipe to pause until the parent resumes
-    // the child.
-    char c;
-    REQUIRE(read(pipefd[0], &c, 1) == 1) << "read failed: " << strerror(errno);
-    close(pipefd[0]);
-    close(pipefd[1]);
+// Write the header of the recording, and the mappings the records build on
+void StartRecording() {
+  RecordingHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+  header.version = RECORDING_VERSION;
+  header.header_size = sizeof(header);
+  header.sample_type = SampleType(options.event);
+  header.sample_period = options.event.period;
+  header.sample_freq = options.event.frequency;
+  header.event_type = options.event.type;
+  header.event_config = options.event.config;
+  header.child_pid = child_pid;
+  if (options.off_cpu) header.flags |= RECORDING_OFF_CPU;
+  if (options.page_faults) header.flags |= RECORDING_PAGE_FAULTS;
+  REQUIRE(recording.Open(options.record_file, header))
+      << "Failed to create " << options.record_file << ": " << strerror(errno);
+  RecordAddressSpace(shards[0], child_pid);
+  if (options.page_faults) RecordDataSpace(shards[0], child_pid);
+}
+
+int main(int argc, char **argv) {
+  int command = ParseOptions(argc, argv);
+
+  if (!options.report_file.empty()) {
+    shards.resize(1);
+    RunReport();
+    return 0;
+  }
+  if (!options.diff_file.empty()) return RunDiff(argv[command]);
 
-    REQUIRE(execvp(argv[1], &argv[1])) << "execvp failed: " << strerror(errno);
+  // Without a usable PMU, as in many VMs and containers, sample a software
+  // clock in place of the hardware event: the thread's own, or the CPU's with
+  // --per-cpu, whose events follow no thread
+  if (options.event.type == PERF_TYPE_HARDWARE ||
+      options.event.type == PERF_TYPE_HW_CACHE ||
+      options.event.type == PERF_TYPE_RAW) {
+    if (!EventAvailable(options.event)) {
+      int error = errno;
+      std::string name = EventName(options.event);
+      REQUIRE(!options.event.counters)
+          << "--counters needs hardware counters, but " << name
+          << " cannot be opened: " << strerror(error);
+      options.event.type = PERF_TYPE_SOFTWARE;
+      options.event.config = options.per_cpu ? PERF_COUNT_SW_CPU_CLOCK
+                                             : PERF_COUNT_SW_TASK_CLOCK;
+      WARNING << name << " cannot be opened (" << strerror(error)
+              << "); sampling " << EventName(options.event) << " instead";
+    }
+  }
+
+  // Initialize one epoll instance per shard, all watching the stop fd
+  stop_fd = eventfd(0, /*flags=*/0);
+  REQUIRE(stop_fd != -1) << "eventfd failed: " << strerror(errno);
+  shards.resize(options.collectors);
+  for (Shard &shard : shards) {
+    shard.epoll_fd = epoll_create1(/*flags=*/0);
+    REQUIRE(shard.epoll_fd != -1)
+        << "epoll_create1 failed: " << strerror(errno);
+    AddToEpoll(shard.epoll_fd, stop_fd);
+
+    // Drain every buffer of the shard on a tick too, unless each wakes it
+    // at every record
+    if (options.wakeup != WAKEUP_RECORD) {
+      shard.tick_fd = timerfd_create(CLOCK_MONOTONIC, /*flags=*/0);
+      REQUIRE(shard.tick_fd != -1)
+          << "timerfd_create failed: " << strerror(errno);
+      uint64_t tick_ms = WAKEUP_FLUSH_MS;
+      if (options.wakeup == WAKEUP_TICK && options.wakeup_value != 0) {
+        tick_ms = options.wakeup_value;
+      } else if (options.wakeup == WAKEUP_TICK ||
+                 options.wakeup == WAKEUP_ADAPTIVE) {
+        tick_ms = WAKEUP_TICK_MS;
+      }
+      SetTick(shard, tick_ms * 1000000);
+      AddToEpoll(shard.epoll_fd, shard.tick_fd);
+    }
+  }
+
+  if (options.attach_pid != 0) {
+    // Leave the process running when interrupted. The signals are blocked
+    // here rather than before forking a command, since exec keeps the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    REQUIRE(sigprocmask(SIG_BLOCK, &signals, NULL) != -1)
+        << "sigprocmask failed: " << strerror(errno);
+    signal_fd = signalfd(-1, &signals, /*flags=*/0);
+    REQUIRE(signal_fd != -1) << "signalfd failed: " << strerror(errno);
+    AddToEpoll(shards[0].epoll_fd, signal_fd);
+
+    child_pid = options.attach_pid;
+    AttachToProcess();
+    address_spaces[child_pid].LoadFromProc(child_pid);
+    if (options.page_faults) {
+      data_spaces[child_pid].LoadFromProc(child_pid, /*data=*/true);
+    }
+    if (!options.record_file.empty()) StartRecording();
+    for (auto &p : perf_libs) p.second.StartSampling();
+    for (PerfLib &p : redirected_events) p.StartSampling();
   } else {
-    // In the parent process
-    PerfLib p;
-    int perf_fd = p.PerfEventOpen(child_pid);
-    AddToEpoll(perf_fd);
-    perf_libs.insert({perf_fd, p});
+    // Create a pipe so the parent can tell the child to exec
+    int pipefd[2];
+    REQUIRE(pipe(pipefd) == 0) << "pipe failed: " << strerror(errno);
+
+    // Create a child process
+    child_pid = fork();
+    REQUIRE(child_pid != -1) << "fork failed: " << strerror(errno);
+
+    if (child_pid == 0) {
+      // In child process. Read from the pipe to pause until the parent
+      // resumes the child.
+      char c;
+      REQUIRE(read(pipefd[0], &c, 1) == 1)
+          << "read failed: " << strerror(errno);
+      close(pipefd[0]);
+      close(pipefd[1]);
+
+      REQUIRE(execvp(argv[command], &argv[command]))
+          << "execvp failed: " << strerror(errno);
+    }
+
+    // In the parent process. The child has no threads yet; the ones it
+    // creates are picked up as they appear.
+    TrackThread(child_pid, child_pid);
+    REQUIRE(OpenThreadEvents(child_pid, /*start=*/false))
+        << "The child exited early";
+
+    // Seed the child's address space. Everything mapped after this point is
+    // reported through MMAP2 records, and its data mappings are taken again
+    // once it has exec'd.
+    address_spaces[child_pid].LoadFromProc(child_pid);
+    if (options.page_faults) {
+      data_spaces[child_pid].LoadFromProc(child_pid, /*data=*/true);
+    }
+    if (!options.record_file.empty()) StartRecording();
 
     // Start sampling
-    p.StartSampling();
+    for (auto &p : perf_libs) p.second.StartSampling();
 
     // Wake up the child process by writing to the pipe
     char c = 'A';
@@ -241,11 +2394,42 @@ int main(int argc, char **argv) {
         << "write failed: " << strerror(errno);
     close(pipefd[0]);
     close(pipefd[1]);
+  }
+
+  // End the profiling window after the given time
+  if (options.duration > 0) {
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, /*flags=*/0);
+    REQUIRE(timer_fd != -1) << "timerfd_create failed: " << strerror(errno);
+    itimerspec window;
+    memset(&window, 0, sizeof(window));
+    window.it_value.tv_sec = static_cast<time_t>(options.duration);
+    window.it_value.tv_nsec = static_cast<long>(
+        (options.duration - window.it_value.tv_sec) * 1e9);
+    REQUIRE(timerfd_settime(timer_fd, /*flags=*/0, &window, NULL) != -1)
+        << "timerfd_settime failed: " << strerror(errno);
+    AddToEpoll(shards[0].epoll_fd, timer_fd);
+  }
 
-    // Start profiling
-    RunProfiler();
+  // Redraw the live view at a fixed interval
+  if (options.top != 0) {
+    refresh_fd = timerfd_create(CLOCK_MONOTONIC, /*flags=*/0);
+    REQUIRE(refresh_fd != -1) << "timerfd_create failed: " << strerror(errno);
+    itimerspec interval;
+    memset(&interval, 0, sizeof(interval));
+    interval.it_interval.tv_sec = static_cast<time_t>(options.top);
+    interval.it_interval.tv_nsec = static_cast<long>(
+        (options.top - interval.it_interval.tv_sec) * 1e9);
+    interval.it_value = interval.it_interval;
+    REQUIRE(timerfd_settime(refresh_fd, /*flags=*/0, &interval, NULL) != -1)
+        << "timerfd_settime failed: " << strerror(errno);
+    AddToEpoll(shards[0].epoll_fd, refresh_fd);
   }
 
+  // Start profiling
+  RunProfiler();
+
+  // A command that outlived the profiling window still runs in the
+  // foreground
+  if (options.attach_pid == 0) waitpid(child_pid, NULL, 0);
   return 0;
 }
-
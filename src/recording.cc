@@ -0,0 +1,109 @@
+#include "recording.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "log.h"
+
+constexpr size_t RecordBuffer::kCapacity;
+
+bool RecordingWriter::Open(const std::string &path,
+                           const RecordingHeader &header) {
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ == -1) return false;
+  Write(&header, sizeof(header));
+  return true;
+}
+
+void RecordingWriter::Write(const void *data, size_t size) {
+  std::lock_guard<std::mutex> guard(lock_);
+  const char *pos = reinterpret_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t written = write(fd_, pos, size);
+    if (written == -1 && errno == EINTR) continue;
+    REQUIRE(written > 0) << "write failed: " << strerror(errno);
+    pos += written;
+    size -= written;
+    size_ += written;
+  }
+}
+
+void RecordingWriter::Close() {
+  if (fd_ != -1) close(fd_);
+  fd_ = -1;
+}
+
+void RecordBuffer::Append(RecordingWriter &writer,
+                          const perf_event_header *record, uint64_t time) {
+  if (data_.size() + sizeof(time) + record->size > kCapacity) Flush(writer);
+  if (data_.capacity() < kCapacity) data_.reserve(kCapacity);
+  const char *time_bytes = reinterpret_cast<const char *>(&time);
+  data_.insert(data_.end(), time_bytes, time_bytes + sizeof(time));
+  const char *bytes = reinterpret_cast<const char *>(record);
+  data_.insert(data_.end(), bytes, bytes + record->size);
+}
+
+void RecordBuffer::Flush(RecordingWriter &writer) {
+  if (data_.empty()) return;
+  writer.Write(data_.data(), data_.size());
+  data_.clear();
+}
+
+RecordingReader::~RecordingReader() {
+  if (data_ != NULL) munmap(const_cast<char *>(data_), size_);
+}
+
+bool RecordingReader::Open(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(RecordingHeader)) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  data_ = reinterpret_cast<const char *>(data);
+  size_ = st.st_size;
+
+  const RecordingHeader &h = header();
+  if (memcmp(h.magic, RECORDING_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != RECORDING_VERSION || h.header_size > size_) {
+    return false;
+  }
+
+  size_t offset = h.header_size;
+  while (offset + sizeof(uint64_t) + sizeof(perf_event_header) <= size_) {
+    uint64_t time;
+    memcpy(&time, data_ + offset, sizeof(time));
+    const perf_event_header *record =
+        reinterpret_cast<const perf_event_header *>(data_ + offset +
+                                                    sizeof(time));
+    // A run that was killed may leave a truncated record at the end
+    if (record->size < sizeof(perf_event_header) ||
+        offset + sizeof(time) + record->size > size_) {
+      break;
+    }
+    order_.push_back({time, offset + sizeof(time)});
+    offset += sizeof(time) + record->size;
+  }
+  // Offsets break ties, which keeps records of the same time in file order
+  std::sort(order_.begin(), order_.end());
+  return true;
+}
+
+const perf_event_header *RecordingReader::NextRecord() {
+  if (next_ == order_.size()) return NULL;
+  return reinterpret_cast<const perf_event_header *>(
+      data_ + order_[next_++].second);
+}
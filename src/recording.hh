@@ -0,0 +1,119 @@
+#ifndef RECORDING_HH
+#define RECORDING_HH
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A recording is a RecordingHeader followed by perf records, copied verbatim
+// from the ring buffers (header and body, 8-byte aligned), each preceded by
+// the 64-bit perf timestamp of when it happened. Keeping the kernel layout
+// means recording costs one memcpy per record, and a report can feed the
+// records through exactly the same code as a live run. Collectors write
+// their records in blocks as they drain their buffers, so the file is only
+// in time order within a block; a report sorts the records by time, so that
+// mappings and new processes come before the samples that need them.
+
+constexpr char RECORDING_MAGIC[8] = {'G', 'P', 'R', 'O', 'F', 'R', 'E', 'C'};
+constexpr uint32_t RECORDING_VERSION = 4;
+
+// Header at the start of a recording
+struct RecordingHeader {
+  char magic[8];           // RECORDING_MAGIC
+  uint32_t version;        // RECORDING_VERSION
+  uint32_t header_size;    // sizeof(RecordingHeader), where records start
+  uint64_t sample_type;    // sample_type of every event that was recorded
+  uint64_t sample_period;  // sample_period of every event that was recorded
+  uint64_t sample_freq;    // sample_freq of every event, or 0 if fixed period
+  int32_t child_pid;       // main process of the recorded run
+  uint32_t flags;          // RECORDING_* flags
+  uint32_t event_type;     // type of the sampled event, as perf_event_attr
+  uint32_t reserved;
+  uint64_t event_config;   // config of the sampled event
+};
+
+// The recording has the context switches of every thread (--off-cpu)
+constexpr uint32_t RECORDING_OFF_CPU = 1;
+
+// The recording has the page faults of every thread (--page-faults)
+constexpr uint32_t RECORDING_PAGE_FAULTS = 2;
+
+// The kernel's PERF_RECORD_LOST only names the event, which means nothing
+// outside the run, so recordings store this record in its place
+constexpr uint32_t RECORD_LOST_SOURCE = 0x10000;
+
+struct LostSourceRecord {
+  perf_event_header header;
+  int32_t tid;    // thread the buffer belonged to, or -1 for per-CPU buffers
+  int32_t cpu;    // cpu the buffer belonged to, or -1 for per-thread buffers
+  uint64_t lost;  // number of records lost
+};
+
+// Writes a recording. Several collectors may write concurrently, each
+// through its own RecordBuffer.
+class RecordingWriter {
+ public:
+  // Create path and write the header
+  // Return false if the file cannot be created
+  bool Open(const std::string &path, const RecordingHeader &header);
+
+  // Append a block of whole records
+  void Write(const void *data, size_t size);
+
+  // Return the number of bytes written so far, header included
+  uint64_t size() const { return size_; }
+
+  void Close();
+
+ private:
+  int fd_ = -1;
+  uint64_t size_ = 0;
+  std::mutex lock_;  // keeps blocks from different collectors apart
+};
+
+// Collects records in memory and hands them to a RecordingWriter in large
+// blocks, so recording costs one write() per megabyte rather than per record
+class RecordBuffer {
+ public:
+  static constexpr size_t kCapacity = 1 << 20;
+
+  // Append record, which happened at time
+  void Append(RecordingWriter &writer, const perf_event_header *record,
+              uint64_t time);
+  void Flush(RecordingWriter &writer);
+
+ private:
+  std::vector<char> data_;
+};
+
+// A recording mapped into memory, read one record at a time
+class RecordingReader {
+ public:
+  ~RecordingReader();
+
+  // Map path, check its header and put its records in time order
+  // Return false if the file cannot be read or is not a recording
+  bool Open(const std::string &path);
+
+  const RecordingHeader &header() const {
+    return *reinterpret_cast<const RecordingHeader *>(data_);
+  }
+
+  // Return the next record in time order, records of the same time in file
+  // order, or NULL at the end of the recording
+  const perf_event_header *NextRecord();
+
+ private:
+  const char *data_ = NULL;
+  size_t size_ = 0;
+  std::vector<std::pair<uint64_t, size_t>> order_;  // (time, offset) of
+                                                    // every record, sorted
+  size_t next_ = 0;  // index in order_ of the next record
+};
+
+#endif  // RECORDING_HH
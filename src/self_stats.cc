@@ -0,0 +1,150 @@
+#include "self_stats.hh"
+
+#include <linux/perf_event.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "perf_lib.hh"
+
+namespace {
+// Return ns in the most readable unit
+std::string FormatNs(double ns) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+  if (ns < 1000) {
+    out << ns << " ns";
+  } else if (ns < 1000000) {
+    out << ns / 1000 << " us";
+  } else if (ns < 1000000000) {
+    out << ns / 1000000 << " ms";
+  } else {
+    out << ns / 1000000000 << " s";
+  }
+  return out.str();
+}
+
+// Return the name of a record type, as in the perf_event_open man page
+std::string RecordTypeName(int type) {
+  switch (type) {
+    case PERF_RECORD_SAMPLE:
+      return "SAMPLE";
+    case PERF_RECORD_MMAP2:
+      return "MMAP2";
+    case PERF_RECORD_COMM:
+      return "COMM";
+    case PERF_RECORD_FORK:
+      return "FORK";
+    case PERF_RECORD_EXIT:
+      return "EXIT";
+    case PERF_RECORD_LOST:
+      return "LOST";
+    case PERF_RECORD_SWITCH:
+      return "SWITCH";
+    case RECORD_SWITCH_SAMPLE:
+      return "SAMPLE (switch)";
+    case RECORD_MINOR_FAULT_SAMPLE:
+      return "SAMPLE (minor fault)";
+    case RECORD_MAJOR_FAULT_SAMPLE:
+      return "SAMPLE (major fault)";
+    case PERF_RECORD_MMAP:
+      return "MMAP";
+    default:
+      return "type " + std::to_string(type);
+  }
+}
+}  // namespace
+
+void LatencyHistogram::Add(uint64_t ns) {
+  int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+  buckets_[bucket < kBuckets ? bucket : kBuckets - 1]++;
+  count_++;
+  total_ += ns;
+  if (ns > max_) max_ = ns;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other) {
+  for (int i = 0; i < kBuckets; i++) buckets_[i] += other.buckets_[i];
+  count_ += other.count_;
+  total_ += other.total_;
+  if (other.max_ > max_) max_ = other.max_;
+}
+
+uint64_t LatencyHistogram::Percentile(double share) const {
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    seen += buckets_[i];
+    if (seen >= share * count_) return std::min(uint64_t(1) << i, max_);
+  }
+  return max_;
+}
+
+void LatencyHistogram::Print(std::ostream &out,
+                             const std::string &name) const {
+  if (count_ == 0) return;
+  out << "  " << name << ": " << count_ << ", total "
+      << FormatNs(total_) << ", mean "
+      << FormatNs(static_cast<double>(total_) / count_) << ", p50 <= "
+      << FormatNs(Percentile(0.5)) << ", p99 <= "
+      << FormatNs(Percentile(0.99)) << ", max " << FormatNs(max_)
+      << std::endl;
+
+  out << "   ";
+  for (int i = 0; i < kBuckets; i++) {
+    if (buckets_[i] == 0) continue;
+    out << " <" << FormatNs(uint64_t(1) << i) << ": " << std::fixed
+        << std::setprecision(1) << 100.0 * buckets_[i] / count_ << "%";
+  }
+  out.unsetf(std::ios::floatfield);
+  out << std::setprecision(6) << std::endl;
+}
+
+void SelfStats::Merge(const SelfStats &other) {
+  waits.Merge(other.waits);
+  wakeups.Merge(other.wakeups);
+  ready_fds += other.ready_fds;
+  for (auto &r : other.records) records[r.first].Merge(r.second);
+  lookups.Merge(other.lookups);
+  unresolved += other.unresolved;
+  symbol_hits += other.symbol_hits;
+  symbol_misses += other.symbol_misses;
+  for (int i = 0; i < 11; i++) fill[i] += other.fill[i];
+}
+
+void SelfStats::Print(std::ostream &out, uint64_t lost) const {
+  out << "Profiler overhead:" << std::endl;
+  waits.Print(out, "blocked in epoll_wait");
+  wakeups.Print(out, "handling a wakeup");
+  if (wakeups.count() != 0) {
+    out << "    " << static_cast<double>(ready_fds) / wakeups.count()
+        << " ready fds per wakeup" << std::endl;
+  }
+  for (auto &r : records) {
+    r.second.Print(out, "handling " + RecordTypeName(r.first));
+  }
+
+  lookups.Print(out, "address_to_function");
+  if (lookups.count() != 0) {
+    out << "    " << unresolved << " found no function" << std::endl;
+  }
+  if (symbol_hits + symbol_misses != 0) {
+    out << "  symbol cache: " << symbol_hits << " hits, " << symbol_misses
+        << " misses" << std::endl;
+  }
+
+  uint64_t drains = 0;
+  for (uint64_t f : fill) drains += f;
+  if (drains != 0) {
+    out << "  ring buffer fill at drain (" << drains << " drains):";
+    for (int i = 0; i < 11; i++) {
+      if (fill[i] == 0) continue;
+      out << " " << (i == 10 ? "full" : std::to_string(i * 10) + "%+") << ": "
+          << std::fixed << std::setprecision(1) << 100.0 * fill[i] / drains
+          << "%";
+    }
+    out.unsetf(std::ios::floatfield);
+    out << std::setprecision(6) << std::endl;
+  }
+  out << "  lost records: " << lost << std::endl;
+}
@@ -0,0 +1,64 @@
+#ifndef SELF_STATS_HH
+#define SELF_STATS_HH
+
+#include <stdint.h>
+#include <time.h>
+
+#include <map>
+#include <ostream>
+#include <string>
+
+// Return the time of CLOCK_MONOTONIC in nanoseconds
+inline uint64_t MonotonicNs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// Durations in nanoseconds, counted in power-of-two buckets
+class LatencyHistogram {
+ public:
+  void Add(uint64_t ns);
+  void Merge(const LatencyHistogram &other);
+
+  uint64_t count() const { return count_; }
+  uint64_t total() const { return total_; }
+
+  // Print one line with the count, mean, percentiles and maximum, and one
+  // with the share of durations in every bucket
+  void Print(std::ostream &out, const std::string &name) const;
+
+ private:
+  // Bucket i holds durations below 2^i ns, and at least 2^(i-1) ns
+  static constexpr int kBuckets = 64;
+
+  // Return a bound that a share of the durations stays within: the top of
+  // their bucket, or the maximum
+  uint64_t Percentile(double share) const;
+
+  uint64_t buckets_[kBuckets] = {};
+  uint64_t count_ = 0;
+  uint64_t total_ = 0;
+  uint64_t max_ = 0;
+};
+
+// What the profiler's own pipeline costs while it collects (--self-stats).
+// Every collector keeps its own, merged when the run is over.
+struct SelfStats {
+  LatencyHistogram waits;    // blocked in epoll_wait
+  LatencyHistogram wakeups;  // handling everything one epoll_wait returned
+  uint64_t ready_fds = 0;    // fds returned over all wakeups
+  std::map<int, LatencyHistogram> records;  // handling one record, by type
+  LatencyHistogram lookups;  // address_to_function calls
+  uint64_t unresolved = 0;   // lookups that found no function
+  uint64_t symbol_hits = 0;  // symbols found in the per-process cache
+  uint64_t symbol_misses = 0;
+  uint64_t fill[11] = {};  // drains by ring buffer fill, in tenths
+
+  void Merge(const SelfStats &other);
+
+  // Print the summary; lost is the number of records the kernel dropped
+  void Print(std::ostream &out, uint64_t lost) const;
+};
+
+#endif  // SELF_STATS_HH
@@ -0,0 +1,30 @@
+#ifndef SYMBOL_NAMES_HH
+#define SYMBOL_NAMES_HH
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Interns function names, so call paths can refer to functions by a small id
+class SymbolNames {
+ public:
+  // Return the id of name, assigning a new one if it was never seen
+  uint32_t Intern(const std::string &name) {
+    auto it = ids_.find(name);
+    if (it != ids_.end()) return it->second;
+    uint32_t id = names_.size();
+    ids_.insert({name, id});
+    names_.push_back(name);
+    return id;
+  }
+
+  const std::string &Name(uint32_t id) const { return names_[id]; }
+
+ private:
+  std::unordered_map<std::string, uint32_t> ids_;
+  std::vector<std::string> names_;  // indexed by id
+};
+
+#endif  // SYMBOL_NAMES_HH
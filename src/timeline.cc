@@ -0,0 +1,214 @@
+#include "timeline.hh"
+
+#include <algorithm>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+namespace {
+// Return s quoted as a JSON string
+std::string QuoteJson(const std::string &s) {
+  std::string quoted = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      quoted += ' ';
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+}  // namespace
+
+void Timeline::AddSample(pid_t pid, pid_t tid, uint64_t time, uint32_t key,
+                         uint64_t weight) {
+  Thread &thread = threads_[tid];
+  thread.pid = pid;
+  thread.slices[time / slice_][key] += weight;
+}
+
+void Timeline::WriteChromeTrace(std::ostream &out, const SymbolNames &names,
+                                const std::string &unit) const {
+  // Trace times are in microseconds, from the earliest time seen
+  uint64_t origin = UINT64_MAX;
+  for (auto &t : threads_) {
+    if (t.second.start != 0) origin = std::min(origin, t.second.start);
+    if (!t.second.slices.empty()) {
+      origin = std::min(origin, t.second.slices.begin()->first * slice_);
+    }
+  }
+  auto micros = [&](uint64_t time) { return (time - origin) / 1000.0; };
+
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  bool first = true;
+  auto begin_event = [&]() {
+    if (!first) out << ",\n";
+    first = false;
+  };
+
+  for (auto &t : threads_) {
+    const Thread &thread = t.second;
+    if (thread.slices.empty()) continue;
+    pid_t tid = t.first;
+
+    // The lifetime covers every slice with samples, so the slices nest in it
+    uint64_t start = thread.slices.begin()->first * slice_;
+    uint64_t end = (thread.slices.rbegin()->first + 1) * slice_;
+    if (thread.start != 0) start = std::min(start, thread.start);
+    if (thread.end != 0) end = std::max(end, thread.end);
+
+    begin_event();
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << thread.pid
+        << ",\"tid\":" << tid << ",\"args\":{\"name\":"
+        << QuoteJson("thread " + std::to_string(tid)) << "}}";
+    begin_event();
+    out << "{\"name\":" << QuoteJson("thread " + std::to_string(tid))
+        << ",\"cat\":\"thread\",\"ph\":\"X\",\"ts\":" << micros(start)
+        << ",\"dur\":" << micros(end) - micros(start)
+        << ",\"pid\":" << thread.pid << ",\"tid\":" << tid << "}";
+
+    // Adjacent slices with the same hottest function become one event
+    auto it = thread.slices.begin();
+    while (it != thread.slices.end()) {
+      auto hottest = [](const Slice &slice) {
+        return std::max_element(slice.begin(), slice.end(),
+                                [](const Slice::value_type &a,
+                                   const Slice::value_type &b) {
+                                  return a.second < b.second;
+                                })
+            ->first;
+      };
+      uint32_t key = hottest(it->second);
+      uint64_t first_slice = it->first;
+      uint64_t last_slice = it->first;
+      uint64_t key_weight = 0;
+      uint64_t total_weight = 0;
+      for (; it != thread.slices.end() && it->first <= last_slice + 1 &&
+             hottest(it->second) == key;
+           ++it) {
+        last_slice = it->first;
+        key_weight += it->second.at(key);
+        for (auto &f : it->second) total_weight += f.second;
+      }
+
+      begin_event();
+      out << "{\"name\":" << QuoteJson(names.Name(key))
+          << ",\"cat\":\"cpu\",\"ph\":\"X\",\"ts\":"
+          << micros(first_slice * slice_) << ",\"dur\":"
+          << micros((last_slice + 1) * slice_) - micros(first_slice * slice_)
+          << ",\"pid\":" << thread.pid << ",\"tid\":" << tid
+          << ",\"args\":{" << QuoteJson(unit) << ":" << key_weight
+          << ",\"share\":" << static_cast<double>(key_weight) / total_weight
+          << "}}";
+    }
+  }
+  out << "\n]}\n";
+}
+
+void Timeline::PrintScalability(std::ostream &out,
+                                const SymbolNames &names) const {
+  // Threads with samples in each slice, and the weight they had there
+  std::map<uint64_t, std::vector<uint64_t>> running;
+  std::vector<std::pair<pid_t, uint64_t>> thread_weights;
+  uint64_t total = 0;
+  for (auto &t : threads_) {
+    uint64_t thread_weight = 0;
+    for (auto &s : t.second.slices) {
+      uint64_t weight = 0;
+      for (auto &f : s.second) weight += f.second;
+      running[s.first].push_back(weight);
+      thread_weight += weight;
+    }
+    if (thread_weight == 0) continue;
+    thread_weights.emplace_back(t.first, thread_weight);
+    total += thread_weight;
+  }
+  if (total == 0) {
+    out << "Scalability: no timed samples" << std::endl;
+    return;
+  }
+
+  // Wall time runs from the first slice with samples to the last
+  uint64_t first_slice = running.begin()->first;
+  uint64_t num_slices = running.rbegin()->first - first_slice + 1;
+  size_t num_threads = thread_weights.size();
+  out << "Scalability: " << num_threads << " threads over "
+      << num_slices * slice_ / 1e6 << " ms (" << slice_ / 1e6
+      << " ms slices)" << std::endl;
+
+  // Load imbalance: the busiest thread against the mean
+  std::sort(thread_weights.begin(), thread_weights.end(),
+            [](const std::pair<pid_t, uint64_t> &a,
+               const std::pair<pid_t, uint64_t> &b) {
+              return a.second > b.second;
+            });
+  for (auto &t : thread_weights) {
+    out << "  thread " << t.first << ": "
+        << 100.0 * t.second / total << "% of the work" << std::endl;
+  }
+  double mean = static_cast<double>(total) / num_threads;
+  out << "  load imbalance (max / mean): "
+      << thread_weights.front().second / mean << std::endl;
+
+  // Concurrency: how many threads ran in each slice
+  std::vector<uint64_t> slices_by_concurrency(num_threads + 1, 0);
+  uint64_t serial_weight = 0;
+  uint64_t running_sum = 0;
+  size_t max_concurrency = 0;
+  for (auto &s : running) {
+    size_t n = s.second.size();
+    slices_by_concurrency[n]++;
+    running_sum += n;
+    max_concurrency = std::max(max_concurrency, n);
+    if (n == 1) serial_weight += s.second[0];
+  }
+  slices_by_concurrency[0] = num_slices - running.size();
+  out << "  threads running:";
+  for (size_t n = 0; n <= max_concurrency; n++) {
+    if (slices_by_concurrency[n] == 0) continue;
+    out << " " << n << ": " << 100.0 * slices_by_concurrency[n] / num_slices
+        << "%";
+  }
+  out << std::endl;
+  out << "  effective parallelism: "
+      << static_cast<double>(running_sum) / running.size() << std::endl;
+
+  // Amdahl's law with the work done while only one thread ran as the serial
+  // part
+  double serial = static_cast<double>(serial_weight) / total;
+  out << "  serial fraction: " << 100.0 * serial << "%" << std::endl;
+  if (serial > 0) {
+    out << "  speedup bound: "
+        << 1 / (serial + (1 - serial) / max_concurrency) << " with "
+        << max_concurrency << " threads, " << 1 / serial
+        << " with unlimited threads" << std::endl;
+  } else {
+    out << "  speedup bound: none from serial work" << std::endl;
+  }
+
+  // Where the serial time goes
+  if (serial_weight == 0) return;
+  std::unordered_map<uint32_t, uint64_t> serial_functions;
+  for (auto &t : threads_) {
+    for (auto &s : t.second.slices) {
+      if (running[s.first].size() != 1) continue;
+      for (auto &f : s.second) serial_functions[f.first] += f.second;
+    }
+  }
+  std::vector<std::pair<uint32_t, uint64_t>> hottest(serial_functions.begin(),
+                                                     serial_functions.end());
+  std::sort(hottest.begin(), hottest.end(),
+            [](const std::pair<uint32_t, uint64_t> &a,
+               const std::pair<uint32_t, uint64_t> &b) {
+              return a.second > b.second;
+            });
+  out << "  hottest serial functions:" << std::endl;
+  for (size_t i = 0; i < hottest.size() && i < 5; i++) {
+    out << "    " << 100.0 * hottest[i].second / serial_weight << "% "
+        << names.Name(hottest[i].first) << std::endl;
+  }
+}
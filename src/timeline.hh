@@ -0,0 +1,59 @@
+#ifndef TIMELINE_HH
+#define TIMELINE_HH
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+#include "symbol_names.hh"
+
+// Samples of every thread bucketed into fixed time slices, to see how the
+// work of a run changes over time: its phases, idle gaps and stragglers
+class Timeline {
+ public:
+  // slice is the length of a time slice in nanoseconds
+  explicit Timeline(uint64_t slice) : slice_(slice) {}
+
+  // Add weight (cycles, or whatever the event counts) sampled at time in function key, on thread tid of
+  // process pid. Times are perf timestamps, in nanoseconds.
+  void AddSample(pid_t pid, pid_t tid, uint64_t time, uint32_t key,
+                 uint64_t weight);
+
+  // Note the time thread tid was created or exited. A thread without them
+  // is taken to live from its first sample to its last.
+  void SetStart(pid_t tid, uint64_t time) { threads_[tid].start = time; }
+  void SetEnd(pid_t tid, uint64_t time) { threads_[tid].end = time; }
+
+  // Write the timeline in the Chrome trace event format, which chrome://tracing
+  // and Perfetto open. Every thread gets one event for its lifetime, with the
+  // hottest function of each run of slices nested in it, with its weight in
+  // unit, like "cycles". Keys must be ids in names
+  void WriteChromeTrace(std::ostream &out, const SymbolNames &names,
+                        const std::string &unit) const;
+
+  // Print how well the threads used the parallelism of the run: the share of
+  // the work each did, how many ran at once, the serial fraction and the
+  // speedups Amdahl's law allows with it. A thread counts as running in a
+  // slice if it has a sample there. Keys must be ids in names
+  void PrintScalability(std::ostream &out, const SymbolNames &names) const;
+
+ private:
+  // Weight per function in one slice
+  using Slice = std::unordered_map<uint32_t, uint64_t>;
+
+  struct Thread {
+    pid_t pid = 0;
+    uint64_t start = 0;  // 0 if unknown
+    uint64_t end = 0;    // 0 if unknown
+    std::map<uint64_t, Slice> slices;  // by slice index (time / slice_)
+  };
+
+  uint64_t slice_;
+  std::map<pid_t, Thread> threads_;
+};
+
+#endif  // TIMELINE_HH
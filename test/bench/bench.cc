@@ -0,0 +1,295 @@
+// Overhead and accuracy benchmark of g-profiler
+//
+// Runs every workload a few times on its own and under the profiler, and
+// writes as JSON how much the profiler slowed it down, how many records it
+// lost, how much CPU it used itself, and how far the cycles it attributed to
+// each function are from the workload's known split. Wall times are the
+// fastest of the runs; the rest is over all runs.
+//
+// Usage: bench [--profiler <path>] [--runs <n>] [--scale <factor>]
+//              [--libs <n>] [-- <profiler options>]
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+// A program with a known split of its cycles between its functions
+struct Workload {
+  std::string name;
+  std::vector<std::string> command;
+  std::map<std::string, double> expected;  // share of the cycles by function
+  bool callchain = false;  // profile with call graphs, read from folded stacks
+};
+
+// What the profiler reported, added up over runs
+struct Profile {
+  std::map<std::string, double> cycles;  // by function
+  double total = 0;
+  double lost = 0;    // records lost
+  double cpu_ms = 0;  // CPU time of the profiler itself
+};
+
+double NowMs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// Run command to the end, and return its wall time in ms. Its stdout goes to
+// output unless that is NULL; stderr is dropped.
+double Run(const std::vector<std::string> &command, std::string *output) {
+  int pipefd[2];
+  if (pipe(pipefd) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  double start = NowMs();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(output != NULL ? pipefd[1] : null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    std::vector<char *> argv;
+    for (const std::string &arg : command) {
+      argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(NULL);
+    execvp(argv[0], argv.data());
+    _exit(127);
+  }
+  close(pipefd[1]);
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+    if (output != NULL) output->append(buffer, n);
+  }
+  close(pipefd[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  double wall = NowMs() - start;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::cerr << command[0] << " failed" << std::endl;
+    exit(1);
+  }
+  return wall;
+}
+
+// Read the cycles by function of the flat report, and the --self-stats
+// summary, from the profiler's output. Without hardware counters the
+// profiler samples a clock, and counts ns instead.
+void ParseReport(const std::string &output, bool flat, Profile *profile) {
+  std::istringstream in(output);
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t cycles = line.find(" cycles ");
+    if (cycles == std::string::npos) cycles = line.find(" ns ");
+    if (flat && line.compare(0, 4, "    ") == 0 && cycles != std::string::npos) {
+      size_t colon = line.rfind(": ", cycles);
+      if (colon == std::string::npos) continue;
+      double count = strtod(line.c_str() + colon + 2, NULL);
+      profile->cycles[line.substr(4, colon - 4)] += count;
+      profile->total += count;
+    } else if (line.compare(0, 16, "  lost records: ") == 0) {
+      profile->lost += strtod(line.c_str() + 16, NULL);
+    } else if (line.compare(0, 21, "  profiler CPU time: ") == 0) {
+      double user = strtod(line.c_str() + 21, NULL);
+      size_t comma = line.find(", ");
+      double system = strtod(line.c_str() + comma + 2, NULL);
+      profile->cpu_ms += user + system;
+    }
+  }
+}
+
+// Read the self cycles by function of folded stacks
+void ParseFolded(const std::string &path, Profile *profile) {
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t space = line.rfind(' ');
+    if (space == std::string::npos) continue;
+    size_t semicolon = line.rfind(';', space);
+    size_t start = semicolon == std::string::npos ? 0 : semicolon + 1;
+    double count = strtod(line.c_str() + space + 1, NULL);
+    profile->cycles[line.substr(start, space - start)] += count;
+    profile->total += count;
+  }
+}
+
+// Return the total variation distance between the expected split and the
+// measured one, in which cycles outside the expected functions count as
+// misattributed: 0 is exact, 1 is all wrong
+double AttributionError(const Workload &workload, const Profile &profile) {
+  if (profile.total == 0) return 1;
+  double error = 0;
+  double attributed = 0;
+  for (auto &e : workload.expected) {
+    auto it = profile.cycles.find(e.first);
+    double measured = it == profile.cycles.end() ? 0 : it->second;
+    error += fabs(measured / profile.total - e.second);
+    attributed += measured;
+  }
+  error += 1 - attributed / profile.total;
+  return error / 2;
+}
+
+std::vector<Workload> Workloads(double scale, int libs) {
+  auto units = [&](double n) {
+    return std::to_string(static_cast<uint64_t>(n * scale));
+  };
+  std::vector<Workload> workloads;
+
+  Workload ratios;
+  ratios.name = "ratios";
+  ratios.command = {"./ratios", "4", "100", units(1000000)};
+  ratios.expected = {{"work_a", 1 / 6.0}, {"work_b", 2 / 6.0},
+                     {"work_c", 3 / 6.0}};
+  workloads.push_back(ratios);
+
+  Workload churn;
+  churn.name = "churn";
+  churn.command = {"./churn", "200", "8", units(2000000)};
+  churn.expected = {{"churn_work", 1}};
+  workloads.push_back(churn);
+
+  Workload recursion;
+  recursion.name = "recursion";
+  recursion.command = {"./recursion", "200", "2000", units(1000)};
+  recursion.expected = {{"recurse", 0.5}, {"flat_work", 0.5}};
+  recursion.callchain = true;
+  workloads.push_back(recursion);
+
+  Workload shlibs;
+  shlibs.name = "shlibs";
+  shlibs.command = {"./shlibs", "libs", std::to_string(libs), "100",
+                    units(100000)};
+  for (int i = 0; i < libs; i++) {
+    shlibs.expected["lib_work_" + std::to_string(i)] = 1.0 / libs;
+  }
+  workloads.push_back(shlibs);
+  return workloads;
+}
+
+void Usage(const char *name) {
+  std::cerr << "Usage: " << name
+            << " [--profiler <path>] [--runs <n>] [--scale <factor>]"
+               " [--libs <n>] [-- <profiler options>]"
+            << std::endl;
+  exit(1);
+}
+
+// Return s quoted as a JSON string
+std::string Quote(const std::string &s) {
+  std::string quoted = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string profiler = "../../g-profiler";
+  int runs = 3;
+  double scale = 1;
+  int libs = 32;
+  std::vector<std::string> profiler_options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      profiler_options.assign(argv + i + 1, argv + argc);
+      break;
+    } else if (arg == "--profiler" && i + 1 < argc) {
+      profiler = argv[++i];
+    } else if (arg == "--runs" && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (arg == "--scale" && i + 1 < argc) {
+      scale = strtod(argv[++i], NULL);
+    } else if (arg == "--libs" && i + 1 < argc) {
+      libs = atoi(argv[++i]);
+    } else {
+      Usage(argv[0]);
+    }
+  }
+  if (runs <= 0 || scale <= 0 || libs <= 0) Usage(argv[0]);
+
+  std::cout << std::fixed << std::setprecision(4);
+  std::cout << "{\"profiler\":" << Quote(profiler)
+            << ",\"profiler_options\":[";
+  for (size_t i = 0; i < profiler_options.size(); i++) {
+    std::cout << (i == 0 ? "" : ",") << Quote(profiler_options[i]);
+  }
+  std::cout << "],\"workloads\":[";
+
+  bool first = true;
+  for (const Workload &workload : Workloads(scale, libs)) {
+    std::cerr << "Running " << workload.name << std::endl;
+
+    std::string folded = "bench-" + workload.name + ".folded";
+    std::vector<std::string> command = {profiler, "--self-stats"};
+    if (workload.callchain) {
+      command.push_back("--folded");
+      command.push_back(folded);
+    }
+    command.insert(command.end(), profiler_options.begin(),
+                   profiler_options.end());
+    command.insert(command.end(), workload.command.begin(),
+                   workload.command.end());
+    double baseline_ms = INFINITY;
+    double profiled_ms = INFINITY;
+    Profile profile;
+    for (int run = 0; run < runs; run++) {
+      baseline_ms = std::min(baseline_ms, Run(workload.command, NULL));
+      std::string output;
+      profiled_ms = std::min(profiled_ms, Run(command, &output));
+      ParseReport(output, !workload.callchain, &profile);
+      if (workload.callchain) {
+        ParseFolded(folded, &profile);
+        unlink(folded.c_str());
+      }
+    }
+
+    std::cout << (first ? "" : ",") << "\n {\"name\":" << Quote(workload.name)
+              << ",\"baseline_ms\":" << baseline_ms
+              << ",\"profiled_ms\":" << profiled_ms
+              << ",\"slowdown\":" << profiled_ms / baseline_ms
+              << ",\"profiler_cpu_ms\":" << profile.cpu_ms / runs
+              << ",\"lost_records\":" << profile.lost / runs
+              << ",\"cycles\":" << profile.total / runs
+              << ",\"attribution_error\":"
+              << AttributionError(workload, profile) << ",\"functions\":{";
+    bool first_function = true;
+    for (auto &e : workload.expected) {
+      auto it = profile.cycles.find(e.first);
+      double measured = it == profile.cycles.end() || profile.total == 0
+                            ? 0
+                            : it->second / profile.total;
+      std::cout << (first_function ? "" : ",") << Quote(e.first)
+                << ":{\"expected\":" << e.second
+                << ",\"measured\":" << measured << "}";
+      first_function = false;
+    }
+    std::cout << "}}";
+    first = false;
+  }
+  std::cout << "\n]}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,43 @@
+// Many short-lived threads, started in waves, that spend all their cycles in
+// churn_work. Threads the profiler misses, or picks up late, show up as
+// error.
+//
+// Usage: churn <threads> <at once> <units>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "work.h"
+
+static uint64_t units;
+
+__attribute__((noinline)) void churn_work(uint64_t n) { SPIN(n); }
+
+void *thread_fn(void *arg) {
+  churn_work(units);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s <threads> <at once> <units>\n", argv[0]);
+    return 1;
+  }
+  int thread_num = atoi(argv[1]);
+  int wave = atoi(argv[2]);
+  units = strtoull(argv[3], NULL, 10);
+
+  pthread_t *threads = malloc(wave * sizeof(pthread_t));
+  for (int started = 0; started < thread_num; started += wave) {
+    int n = thread_num - started < wave ? thread_num - started : wave;
+    for (int i = 0; i < n; i++) {
+      pthread_create(&threads[i], NULL, thread_fn, NULL);
+    }
+    for (int i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  free(threads);
+  return 0;
+}
@@ -0,0 +1,9 @@
+// One of the shared libraries of the shlibs workload, built once per LIB_ID
+// with a function of its own name: lib_work_<LIB_ID>
+
+#include "work.h"
+
+#define CONCAT(a, b) a##b
+#define LIB_FUNCTION(id) CONCAT(lib_work_, id)
+
+void LIB_FUNCTION(LIB_ID)(uint64_t n) { SPIN(n); }
@@ -0,0 +1,46 @@
+// N threads that each spend their cycles in work_a, work_b and work_c in the
+// ratio 1:2:3, in small interleaved rounds
+//
+// Usage: ratios <threads> <rounds> <units>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "work.h"
+
+static uint64_t rounds;
+static uint64_t units;
+
+__attribute__((noinline)) void work_a(uint64_t n) { SPIN(n); }
+__attribute__((noinline)) void work_b(uint64_t n) { SPIN(n); }
+__attribute__((noinline)) void work_c(uint64_t n) { SPIN(n); }
+
+void *thread_fn(void *arg) {
+  for (uint64_t r = 0; r < rounds; r++) {
+    work_a(units);
+    work_b(2 * units);
+    work_c(3 * units);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s <threads> <rounds> <units>\n", argv[0]);
+    return 1;
+  }
+  int thread_num = atoi(argv[1]);
+  rounds = strtoull(argv[2], NULL, 10);
+  units = strtoull(argv[3], NULL, 10);
+
+  pthread_t *threads = malloc(thread_num * sizeof(pthread_t));
+  for (int i = 0; i < thread_num; i++) {
+    pthread_create(&threads[i], NULL, thread_fn, NULL);
+  }
+  for (int i = 0; i < thread_num; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  return 0;
+}
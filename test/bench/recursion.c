@@ -0,0 +1,36 @@
+// Deep recursion, deeper than the kernel's default callchain limit, against
+// the same cycles in a flat function: recurse and flat_work get half each
+//
+// Usage: recursion <depth> <rounds> <units>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "work.h"
+
+static uint64_t units;
+
+// Spins on the way down and on the way back, so the call is not a tail call
+__attribute__((noinline)) void recurse(int depth) {
+  SPIN(units / 2);
+  if (depth > 0) recurse(depth - 1);
+  SPIN(units - units / 2);
+}
+
+__attribute__((noinline)) void flat_work(uint64_t n) { SPIN(n); }
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s <depth> <rounds> <units>\n", argv[0]);
+    return 1;
+  }
+  int depth = atoi(argv[1]);
+  uint64_t rounds = strtoull(argv[2], NULL, 10);
+  units = strtoull(argv[3], NULL, 10);
+
+  for (uint64_t r = 0; r < rounds; r++) {
+    recurse(depth);
+    flat_work((depth + 1) * units);
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+// Equal cycles in the functions of many shared libraries, loaded with dlopen:
+// lib_work_<i> of <dir>/libbench_<i>.so gets 1/<libs> of the cycles
+//
+// Usage: shlibs <dir> <libs> <rounds> <units>
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef void (*work_fn)(uint64_t);
+
+int main(int argc, char **argv) {
+  if (argc != 5) {
+    fprintf(stderr, "Usage: %s <dir> <libs> <rounds> <units>\n", argv[0]);
+    return 1;
+  }
+  int lib_num = atoi(argv[2]);
+  uint64_t rounds = strtoull(argv[3], NULL, 10);
+  uint64_t units = strtoull(argv[4], NULL, 10);
+
+  work_fn *functions = malloc(lib_num * sizeof(work_fn));
+  for (int i = 0; i < lib_num; i++) {
+    char path[4096];
+    char name[64];
+    snprintf(path, sizeof(path), "%s/libbench_%d.so", argv[1], i);
+    snprintf(name, sizeof(name), "lib_work_%d", i);
+    void *lib = dlopen(path, RTLD_NOW);
+    if (lib == NULL) {
+      fprintf(stderr, "%s\n", dlerror());
+      return 1;
+    }
+    functions[i] = (work_fn)dlsym(lib, name);
+    if (functions[i] == NULL) {
+      fprintf(stderr, "%s\n", dlerror());
+      return 1;
+    }
+  }
+
+  for (uint64_t r = 0; r < rounds; r++) {
+    for (int i = 0; i < lib_num; i++) functions[i](units);
+  }
+  free(functions);
+  return 0;
+}
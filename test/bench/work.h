@@ -0,0 +1,17 @@
+#ifndef WORK_H
+#define WORK_H
+
+#include <stdint.h>
+
+// Spin for n iterations. Every function that spins does so with this same
+// loop, so the cycles of the functions of a workload are in the ratio of the
+// iterations they are given; that ratio is the ground truth the profile is
+// checked against.
+#define SPIN(n)                                      \
+  do {                                               \
+    volatile uint64_t spin_sink = 0;                 \
+    for (uint64_t spin_i = 0; spin_i < (n); spin_i++) \
+      spin_sink += spin_i;                           \
+  } while (0)
+
+#endif
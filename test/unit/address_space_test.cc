@@ -0,0 +1,101 @@
+#include "address_space.hh"
+
+#include "check.hh"
+
+TEST(FindMappingUsesHalfOpenRanges) {
+  AddressSpace space;
+  space.AddMapping(0x1000, 0x1000, 0, "/bin/a");
+  CHECK(space.FindMapping(0xfff) == NULL);
+  CHECK(space.FindMapping(0x1000) != NULL);
+  CHECK(space.FindMapping(0x1fff) != NULL);
+  CHECK(space.FindMapping(0x2000) == NULL);
+}
+
+TEST(AddMappingKeepsMappingsSorted) {
+  AddressSpace space;
+  space.AddMapping(0x5000, 0x1000, 0, "/lib/c");
+  space.AddMapping(0x1000, 0x1000, 0, "/bin/a");
+  space.AddMapping(0x3000, 0x1000, 0, "/lib/b");
+  CHECK_EQ(space.size(), 3u);
+  CHECK_EQ(space.mappings()[0].filename, "/bin/a");
+  CHECK_EQ(space.mappings()[1].filename, "/lib/b");
+  CHECK_EQ(space.mappings()[2].filename, "/lib/c");
+  CHECK_EQ(space.FindMapping(0x3800)->filename, "/lib/b");
+}
+
+TEST(AddMappingSplitsTheMappingItLandsIn) {
+  AddressSpace space;
+  space.AddMapping(0x1000, 0x4000, 0x10000, "/bin/a");
+  space.AddMapping(0x2000, 0x1000, 0, "/lib/b");
+  CHECK_EQ(space.size(), 3u);
+
+  const Mapping &left = space.mappings()[0];
+  CHECK_EQ(left.start, 0x1000u);
+  CHECK_EQ(left.end, 0x2000u);
+  CHECK_EQ(left.pgoff, 0x10000u);
+
+  const Mapping &middle = space.mappings()[1];
+  CHECK_EQ(middle.filename, "/lib/b");
+  CHECK_EQ(middle.start, 0x2000u);
+  CHECK_EQ(middle.end, 0x3000u);
+
+  // The right piece still maps the file where it did before the split
+  const Mapping &right = space.mappings()[2];
+  CHECK_EQ(right.filename, "/bin/a");
+  CHECK_EQ(right.start, 0x3000u);
+  CHECK_EQ(right.end, 0x5000u);
+  CHECK_EQ(right.pgoff, 0x12000u);
+}
+
+TEST(AddMappingTrimsAndReplacesOverlappedMappings) {
+  AddressSpace space;
+  space.AddMapping(0x1000, 0x2000, 0, "/bin/a");
+  space.AddMapping(0x3000, 0x1000, 0, "/lib/b");
+  space.AddMapping(0x4000, 0x2000, 0, "/lib/c");
+  // Cuts the end of a, covers all of b and the start of c
+  space.AddMapping(0x2000, 0x3000, 0, "/lib/d");
+  CHECK_EQ(space.size(), 3u);
+  CHECK_EQ(space.mappings()[0].end, 0x2000u);
+  CHECK_EQ(space.mappings()[1].filename, "/lib/d");
+  CHECK_EQ(space.mappings()[2].filename, "/lib/c");
+  CHECK_EQ(space.mappings()[2].start, 0x5000u);
+  CHECK_EQ(space.mappings()[2].pgoff, 0x1000u);
+  CHECK_EQ(space.FindMapping(0x3800)->filename, "/lib/d");
+}
+
+TEST(AddMappingReplacesAnIdenticalRange) {
+  AddressSpace space;
+  space.AddMapping(0x1000, 0x1000, 0, "/lib/a");
+  space.AddMapping(0x1000, 0x1000, 0, "/lib/b");
+  CHECK_EQ(space.size(), 1u);
+  CHECK_EQ(space.FindMapping(0x1000)->filename, "/lib/b");
+}
+
+TEST(ClearForgetsEveryMapping) {
+  AddressSpace space;
+  space.AddMapping(0x1000, 0x1000, 0, "/bin/a");
+  space.Clear();
+  CHECK_EQ(space.size(), 0u);
+  CHECK(space.FindMapping(0x1000) == NULL);
+}
+
+TEST(OverwritesIgnoresTheSameFileAtTheSameOffset) {
+  AddressSpace space;
+  space.AddMapping(0x1000, 0x3000, 0x10000, "/lib/a");
+  // Remapping part of it (as mprotect does) changes nothing
+  CHECK(!space.Overwrites(0x2000, 0x1000, 0x11000, "/lib/a"));
+  // Nor does mapping unmapped memory
+  CHECK(!space.Overwrites(0x8000, 0x1000, 0, "/lib/b"));
+}
+
+TEST(OverwritesDetectsAnotherFileOrOffset) {
+  AddressSpace space;
+  space.AddMapping(0x1000, 0x3000, 0x10000, "/lib/a");
+  space.AddMapping(0x5000, 0x1000, 0, "/lib/c");
+  CHECK(space.Overwrites(0x2000, 0x1000, 0, "/lib/b"));
+  CHECK(space.Overwrites(0x2000, 0x1000, 0x10000, "/lib/a"));
+  // Only the second mapping it overlaps differs
+  CHECK(space.Overwrites(0x3000, 0x3000, 0x12000, "/lib/a"));
+}
+
+int main() { return RunTests(); }
@@ -0,0 +1,105 @@
+#include "calling_context_tree.hh"
+
+#include <linux/perf_event.h>
+
+#include "check.hh"
+
+// Frames are given leaf first, as perf reports them; main=1, a=2, b=3, c=4
+static void Add(CallingContextTree *tree, std::vector<uint64_t> frames,
+                uint64_t count = 1) {
+  tree->AddStack(frames.data(), frames.size(), count);
+}
+
+TEST(CostsRollUpToCallers) {
+  CallingContextTree tree;
+  Add(&tree, {2, 1}, 3);     // main -> a
+  Add(&tree, {3, 2, 1}, 5);  // main -> a -> b
+  Add(&tree, {3, 1}, 2);     // main -> b
+  Add(&tree, {1});           // main
+  CHECK_EQ(tree.total(), 11u);
+
+  auto costs = tree.Costs();
+  CHECK_EQ(costs.size(), 3u);
+  CHECK_EQ(costs[1].exclusive, 1u);
+  CHECK_EQ(costs[1].inclusive, 11u);
+  CHECK_EQ(costs[2].exclusive, 3u);
+  CHECK_EQ(costs[2].inclusive, 8u);
+  CHECK_EQ(costs[3].exclusive, 7u);
+  CHECK_EQ(costs[3].inclusive, 7u);
+}
+
+TEST(RecursionCountsOnceTowardsInclusiveCost) {
+  CallingContextTree tree;
+  Add(&tree, {2, 2, 2, 1}, 4);  // main -> a -> a -> a
+  Add(&tree, {3, 2, 2, 1}, 1);  // main -> a -> a -> b
+  Add(&tree, {2, 1}, 2);        // main -> a
+
+  auto costs = tree.Costs();
+  CHECK_EQ(costs[2].exclusive, 6u);
+  CHECK_EQ(costs[2].inclusive, 7u);
+  CHECK_EQ(costs[3].inclusive, 1u);
+  CHECK_EQ(costs[1].inclusive, 7u);
+}
+
+TEST(SameStackSharesOneNode) {
+  CallingContextTree tree;
+  Add(&tree, {2, 1});
+  Add(&tree, {3, 1});
+  Add(&tree, {2, 1});
+  // root, main, a, b
+  CHECK_EQ(tree.nodes().size(), 4u);
+}
+
+TEST(AddStackSkipsContextMarkers) {
+  CallingContextTree tree;
+  Add(&tree, {PERF_CONTEXT_KERNEL, 0xffffffff81000000ULL, PERF_CONTEXT_USER,
+              2, 1});
+  auto costs = tree.Costs();
+  CHECK_EQ(costs.size(), 3u);
+  CHECK(costs.find(PERF_CONTEXT_USER) == costs.end());
+  CHECK_EQ(costs[0xffffffff81000000ULL].exclusive, 1u);
+  CHECK_EQ(costs[1].inclusive, 1u);
+}
+
+TEST(MergeAddsEveryStack) {
+  CallingContextTree first, second;
+  Add(&first, {2, 1}, 2);
+  Add(&second, {2, 1}, 3);
+  Add(&second, {3, 1}, 1);
+  first.Merge(second);
+  CHECK_EQ(first.total(), 6u);
+  auto costs = first.Costs();
+  CHECK_EQ(costs[2].exclusive, 5u);
+  CHECK_EQ(costs[3].exclusive, 1u);
+  CHECK_EQ(costs[1].inclusive, 6u);
+}
+
+TEST(MergeUnderAddsAnOutermostFrame) {
+  CallingContextTree thread, process;
+  Add(&thread, {2, 1}, 4);
+  process.MergeUnder(100, thread);
+  process.MergeUnder(101, thread);
+  CHECK_EQ(process.total(), 8u);
+  auto costs = process.Costs();
+  CHECK_EQ(costs[100].inclusive, 4u);
+  CHECK_EQ(costs[101].inclusive, 4u);
+  CHECK_EQ(costs[100].exclusive, 0u);
+  CHECK_EQ(costs[2].exclusive, 8u);
+}
+
+TEST(RemapMergesPathsThatBecomeEqual) {
+  // Two ips of a (0x20, 0x24) called from main (0x10)
+  CallingContextTree ips;
+  Add(&ips, {0x20, 0x10}, 2);
+  Add(&ips, {0x24, 0x10}, 3);
+  CallingContextTree functions =
+      ips.Remap([](uint64_t ip) { return ip >> 4; });
+  CHECK_EQ(functions.total(), 5u);
+  // root, main, a
+  CHECK_EQ(functions.nodes().size(), 3u);
+  auto costs = functions.Costs();
+  CHECK_EQ(costs[2].exclusive, 5u);
+  CHECK_EQ(costs[1].inclusive, 5u);
+}
+
+int main() { return RunTests(); }
@@ -0,0 +1,69 @@
+#ifndef CHECK_HH
+#define CHECK_HH
+
+#include <iostream>
+#include <vector>
+
+// A minimal test harness, so the unit tests need nothing but the compiler.
+// TEST(name) defines a test case, CHECK and CHECK_EQ report a failure without
+// stopping it, and RunTests() runs every case and returns the exit status.
+
+struct TestCase {
+  const char *name;
+  void (*run)();
+};
+
+inline std::vector<TestCase> &TestCases() {
+  static std::vector<TestCase> cases;
+  return cases;
+}
+
+inline int &TestFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+struct TestRegistrar {
+  TestRegistrar(const char *name, void (*run)()) {
+    TestCases().push_back({name, run});
+  }
+};
+
+#define TEST(name)                                   \
+  static void name();                                \
+  static TestRegistrar name##_registrar(#name, name); \
+  static void name()
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond    \
+                << ") failed" << std::endl;                           \
+      ++TestFailures();                                               \
+    }                                                                 \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                                    \
+  do {                                                                    \
+    auto check_a = (a);                                                   \
+    auto check_b = (b);                                                   \
+    if (!(check_a == check_b)) {                                          \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #a ", " #b \
+                << ") failed: " << check_a << " != " << check_b           \
+                << std::endl;                                             \
+      ++TestFailures();                                                   \
+    }                                                                     \
+  } while (0)
+
+// Run every test case; return 0 if all checks passed, 1 otherwise
+inline int RunTests() {
+  for (const TestCase &test : TestCases()) {
+    int before = TestFailures();
+    test.run();
+    std::cerr << (TestFailures() == before ? "PASS " : "FAIL ") << test.name
+              << std::endl;
+  }
+  return TestFailures() == 0 ? 0 : 1;
+}
+
+#endif  // CHECK_HH
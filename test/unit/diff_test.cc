@@ -0,0 +1,240 @@
+#include "diff.hh"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "calling_context_tree.hh"
+#include "check.hh"
+#include "flamegraph.hh"
+#include "symbol_names.hh"
+
+// A run whose only role has the given cycles per function, sampled every
+// period cycles
+static Profile Run(std::map<std::string, uint64_t> functions,
+                   uint64_t period) {
+  Profile profile;
+  for (auto &f : functions) {
+    profile.roles["worker"][f.first] = f.second;
+    profile.samples += f.second / period;
+  }
+  return profile;
+}
+
+// The line of the diff that ends with name, or "" if there is none
+static std::string LineOf(const std::string &diff, const std::string &name) {
+  std::istringstream in(diff);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.size() >= name.size() &&
+        line.compare(line.size() - name.size(), name.size(), name) == 0) {
+      return line;
+    }
+  }
+  return "";
+}
+
+// The z score printed on the line of name
+static double ZOf(const std::string &diff, const std::string &name) {
+  std::string line = LineOf(diff, name);
+  size_t z = line.find(" z ");
+  CHECK(z != std::string::npos);
+  return z == std::string::npos ? 0 : atof(line.c_str() + z + 3);
+}
+
+static bool Significant(const std::string &diff, const std::string &name) {
+  return LineOf(diff, name).find(" *  ") != std::string::npos;
+}
+
+TEST(SameRunsDoNotDiffer) {
+  Profile run = Run({{"a", 600000}, {"b", 400000}}, 1000);
+  std::ostringstream out;
+  CHECK(!PrintDiff(out, run, run, DIFF_BY_SHARE, 0));
+  CHECK_EQ(ZOf(out.str(), "a"), 0.0);
+  CHECK(!Significant(out.str(), "a"));
+  CHECK(!Significant(out.str(), "worker"));
+}
+
+TEST(ShareZScoreIsATwoProportionTest) {
+  // 600 of 1000 samples in a, then 500 of 1000: p = 0.55, and
+  // z = -0.1 / sqrt(0.55 * 0.45 * 2 / 1000) = -4.49
+  Profile base = Run({{"a", 600000}, {"b", 400000}}, 1000);
+  Profile next = Run({{"a", 500000}, {"b", 500000}}, 1000);
+  std::ostringstream out;
+  CHECK(PrintDiff(out, base, next, DIFF_BY_SHARE, 2));
+  CHECK(fabs(ZOf(out.str(), "a") + 4.49) < 0.01);
+  CHECK(fabs(ZOf(out.str(), "b") - 4.49) < 0.01);
+  CHECK(Significant(out.str(), "b"));
+  CHECK(LineOf(out.str(), "b").find("+10.00%") != std::string::npos);
+}
+
+TEST(FewSamplesAreNotSignificant) {
+  // The same shares from 10 samples a run
+  Profile base = Run({{"a", 600000}, {"b", 400000}}, 100000);
+  Profile next = Run({{"a", 500000}, {"b", 500000}}, 100000);
+  std::ostringstream out;
+  CHECK(!PrintDiff(out, base, next, DIFF_BY_SHARE, 2));
+  CHECK(fabs(ZOf(out.str(), "b") - 0.45) < 0.01);
+  CHECK(!Significant(out.str(), "b"));
+}
+
+TEST(FailAboveNeedsALargeEnoughChange) {
+  Profile base = Run({{"a", 600000}, {"b", 400000}}, 1000);
+  Profile next = Run({{"a", 500000}, {"b", 500000}}, 1000);
+  std::ostringstream out;
+  CHECK(!PrintDiff(out, base, next, DIFF_BY_SHARE, 20));
+  CHECK(!PrintDiff(out, base, next, DIFF_BY_SHARE, -1));
+}
+
+TEST(CyclesZScoreUsesPoissonCounts) {
+  // 400 samples of b, then 600, each of 1000 cycles:
+  // z = 200000 / (1000 * sqrt(400 + 600)) = 6.32
+  Profile base = Run({{"a", 600000}, {"b", 400000}}, 1000);
+  Profile next = Run({{"a", 600000}, {"b", 600000}}, 1000);
+  std::ostringstream out;
+  CHECK(PrintDiff(out, base, next, DIFF_BY_CYCLES, 2));
+  CHECK(fabs(ZOf(out.str(), "b") - 6.32) < 0.01);
+  CHECK_EQ(ZOf(out.str(), "a"), 0.0);
+  CHECK(LineOf(out.str(), "b").find("+20.00%") != std::string::npos);
+}
+
+TEST(RunsWithoutSamplesAreNotCompared) {
+  Profile empty;
+  Profile run = Run({{"a", 1000}}, 1000);
+  std::ostringstream out;
+  CHECK(!PrintDiff(out, empty, run, DIFF_BY_SHARE, 0));
+  CHECK(out.str().find("Nothing to compare") != std::string::npos);
+}
+
+// Folded stacks in a temporary file, with the samples file next to it if
+// samples is given, removed when it goes out of scope
+class FoldedFile {
+ public:
+  explicit FoldedFile(const std::string &contents,
+                      const std::string &samples = "") {
+    char path[] = "/tmp/diff_test.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    CHECK_EQ(write(fd, contents.data(), contents.size()),
+             ssize_t(contents.size()));
+    close(fd);
+    path_ = path;
+    if (!samples.empty()) std::ofstream(samples_path()) << samples;
+  }
+  ~FoldedFile() {
+    unlink(path_.c_str());
+    unlink(samples_path().c_str());
+  }
+
+  std::string samples_path() const { return path_ + FOLDED_SAMPLES_SUFFIX; }
+
+  const std::string &path() const { return path_; }
+
+ private:
+  std::string path_;
+};
+
+TEST(ReadFoldedProfileTakesTheInnermostFrames) {
+  FoldedFile file(
+      "thread 1;main;a 3000\n"
+      "thread 1;main;a;b 2000\n"
+      "thread 2;main;b 5000\n");
+  Profile profile;
+  CHECK(ReadFoldedProfile(file.path(), &profile));
+  CHECK_EQ(profile.roles.size(), 1u);
+  CHECK_EQ(profile.roles["all"]["a"], 3000u);
+  CHECK_EQ(profile.roles["all"]["b"], 7000u);
+  CHECK_EQ(profile.roles["all"].count("main"), 0u);
+}
+
+TEST(ReadFoldedProfileRejectsOtherFiles) {
+  FoldedFile file("not folded stacks\n");
+  Profile profile;
+  CHECK(!ReadFoldedProfile(file.path(), &profile));
+  CHECK(!ReadFoldedProfile(file.path() + ".missing", &profile));
+}
+
+TEST(ReadFoldedProfileReadsTheSamplesFile) {
+  FoldedFile file("thread 1;main;a 3000\n", "3 samples of ns\n");
+  Profile profile;
+  CHECK(ReadFoldedProfile(file.path(), &profile));
+  CHECK_EQ(profile.samples, 3u);
+  CHECK_EQ(profile.unit, "ns");
+  CHECK_EQ(profile.roles["all"]["a"], 3000u);
+
+  FoldedFile bad("thread 1;main;a 3000\n", "many samples\n");
+  CHECK(!ReadFoldedProfile(bad.path(), &profile));
+}
+
+TEST(FoldedStacksOfOtherToolsHaveNoZScores) {
+  FoldedFile base("main;a 600000\nmain;b 400000\n");
+  FoldedFile next("main;a 500000\nmain;b 500000\n");
+  Profile base_profile, next_profile;
+  CHECK(ReadFoldedProfile(base.path(), &base_profile));
+  CHECK(ReadFoldedProfile(next.path(), &next_profile));
+  CHECK_EQ(base_profile.samples, 0u);
+
+  // Without z scores, any large enough change fails
+  std::ostringstream out;
+  CHECK(PrintDiff(out, base_profile, next_profile, DIFF_BY_SHARE, 2));
+  CHECK(out.str().find("unknown number of samples") != std::string::npos);
+  CHECK(LineOf(out.str(), "b").find("z      -") != std::string::npos);
+  CHECK(!Significant(out.str(), "b"));
+}
+
+// Write the folded stacks of a run sampled at a varying period, as with
+// --freq, and their samples file: samples of the given periods in a, then
+// in b
+static void WriteFreqRun(const FoldedFile &file,
+                         const std::vector<uint64_t> &periods,
+                         size_t samples_in_a) {
+  SymbolNames names;
+  uint64_t frames_a[] = {names.Intern("a"), names.Intern("main")};
+  uint64_t frames_b[] = {names.Intern("b"), names.Intern("main")};
+  CallingContextTree cct;
+  for (size_t i = 0; i < periods.size(); i++) {
+    cct.AddStack(i < samples_in_a ? frames_a : frames_b, 2, periods[i]);
+  }
+  std::ofstream out(file.path());
+  WriteFoldedStacks(out, cct, names);
+  std::ofstream samples(file.samples_path());
+  WriteFoldedSamples(samples, periods.size(), "cycles");
+}
+
+TEST(DiffOfFreqProfilesUsesTheirSampleCounts) {
+  // 100 samples a run, with periods that have no common divisor; a's share
+  // of the samples goes from 50% to 56%, well within sampling noise
+  std::vector<uint64_t> periods;
+  for (uint64_t i = 0; i < 100; i++) periods.push_back(9001 + 20 * i);
+  FoldedFile base(""), next("");
+  WriteFreqRun(base, periods, 50);
+  WriteFreqRun(next, periods, 56);
+
+  // Flame graph tools get nothing but stack lines
+  std::ifstream in(base.path());
+  std::string line;
+  while (std::getline(in, line)) {
+    CHECK(line.find("main;") == 0);
+    CHECK(isdigit(line.back()));
+  }
+
+  Profile base_profile, next_profile;
+  CHECK(ReadFoldedProfile(base.path(), &base_profile));
+  CHECK(ReadFoldedProfile(next.path(), &next_profile));
+  CHECK_EQ(base_profile.samples, 100u);
+  CHECK_EQ(next_profile.samples, 100u);
+  CHECK_EQ(next_profile.unit, "cycles");
+
+  std::ostringstream out;
+  CHECK(!PrintDiff(out, base_profile, next_profile, DIFF_BY_SHARE, 2));
+  CHECK(fabs(ZOf(out.str(), "a")) < 1.5);
+  CHECK(!Significant(out.str(), "a"));
+}
+
+int main() { return RunTests(); }
@@ -0,0 +1,65 @@
+#include "ip_histogram.hh"
+
+#include <map>
+
+#include "check.hh"
+
+// Collect the histogram into an ordered map, to compare it as a whole
+static std::map<uint64_t, uint64_t> Counts(const IpHistogram &histogram) {
+  std::map<uint64_t, uint64_t> counts;
+  histogram.ForEach([&](uint64_t ip, uint64_t count) {
+    CHECK(counts.find(ip) == counts.end());
+    counts[ip] = count;
+  });
+  return counts;
+}
+
+TEST(EmptyHistogramHasNoSamples) {
+  IpHistogram histogram;
+  CHECK_EQ(histogram.size(), 0u);
+  CHECK_EQ(histogram.total(), 0u);
+  CHECK(Counts(histogram).empty());
+}
+
+TEST(AddSumsCountsOfTheSameIp) {
+  IpHistogram histogram;
+  histogram.Add(0x401000);
+  histogram.Add(0x401000, 5);
+  histogram.Add(0x401004, 2);
+  CHECK_EQ(histogram.size(), 2u);
+  CHECK_EQ(histogram.total(), 8u);
+  std::map<uint64_t, uint64_t> counts = Counts(histogram);
+  CHECK_EQ(counts[0x401000], 6u);
+  CHECK_EQ(counts[0x401004], 2u);
+}
+
+TEST(IpZeroIsAnOrdinaryKey) {
+  IpHistogram histogram;
+  histogram.Add(0, 3);
+  histogram.Add(0);
+  CHECK_EQ(histogram.size(), 1u);
+  CHECK_EQ(Counts(histogram)[0], 4u);
+}
+
+TEST(GrowingKeepsEveryCount) {
+  IpHistogram histogram;
+  std::map<uint64_t, uint64_t> expected;
+  // Nearby ips, as in a hot loop, and far apart ones, as in shared libraries,
+  // many times the initial capacity
+  for (uint64_t i = 0; i < 5000; i++) {
+    uint64_t ip = (i % 2 ? 0x400000 + i : 0x7f0000000000 + (i << 20));
+    histogram.Add(ip, i % 7 + 1);
+    expected[ip] += i % 7 + 1;
+    if (i % 3 == 0) {
+      histogram.Add(ip);
+      expected[ip]++;
+    }
+  }
+  uint64_t total = 0;
+  for (const auto &entry : expected) total += entry.second;
+  CHECK_EQ(histogram.size(), expected.size());
+  CHECK_EQ(histogram.total(), total);
+  CHECK(Counts(histogram) == expected);
+}
+
+int main() { return RunTests(); }
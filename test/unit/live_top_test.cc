@@ -0,0 +1,85 @@
+#include "live_top.hh"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "check.hh"
+
+// The lines of the live view that list functions, without indentation
+static std::vector<std::string> Lines(const LiveTop &top,
+                                      const SymbolNames &names,
+                                      size_t threads = 0,
+                                      size_t functions = 10) {
+  std::ostringstream out;
+  top.Print(out, names, threads, functions, "cycles");
+  std::istringstream in(out.str());
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(in, line)) {
+    lines.push_back(line.substr(line.find_first_not_of(' ')));
+  }
+  return lines;
+}
+
+TEST(PrintsSharesInDescendingOrder) {
+  SymbolNames names;
+  LiveTop top(0.5);
+  top.Add(1, names.Intern("small"), 100);
+  top.Add(1, names.Intern("large"), 300);
+  std::vector<std::string> lines = Lines(top, names);
+  CHECK_EQ(lines.size(), 4u);
+  CHECK_EQ(lines[0], "400 cycles since the last refresh");
+  CHECK_EQ(lines[1], "Overall:");
+  CHECK_EQ(lines[2], "75.0%  large");
+  CHECK_EQ(lines[3], "25.0%  small");
+}
+
+TEST(DecayFavoursRecentSamples) {
+  SymbolNames names;
+  LiveTop top(0.5);
+  top.Add(1, names.Intern("old"), 200);
+  top.Decay();
+  // Worth 200 before the refresh and 100 after it, so 150 overtakes it
+  top.Add(1, names.Intern("new"), 150);
+  std::vector<std::string> lines = Lines(top, names);
+  CHECK_EQ(lines.size(), 4u);
+  CHECK_EQ(lines[0], "150 cycles since the last refresh");
+  CHECK_EQ(lines[2], "60.0%  new");
+  CHECK_EQ(lines[3], "40.0%  old");
+}
+
+TEST(PrintsTheHottestThreads) {
+  SymbolNames names;
+  LiveTop top(0.5);
+  top.Add(10, names.Intern("a"), 100);
+  top.Add(11, names.Intern("b"), 300);
+  top.Add(12, names.Intern("c"), 600);
+  std::vector<std::string> lines = Lines(top, names, 2, 1);
+  CHECK_EQ(lines.size(), 7u);
+  CHECK_EQ(lines[2], "60.0%  c");
+  CHECK_EQ(lines[3], "Thread 12 (60.0%):");
+  CHECK_EQ(lines[4], "100.0%  c");
+  CHECK_EQ(lines[5], "Thread 11 (30.0%):");
+  CHECK_EQ(lines[6], "100.0%  b");
+}
+
+TEST(RescalingDropsLongStoppedFunctions) {
+  SymbolNames names;
+  LiveTop top(0.5);
+  top.Add(10, names.Intern("stopped"), 1000);
+  // Scales new samples up by 2^120, well past the point where every table is
+  // scaled down instead
+  for (int i = 0; i < 120; i++) {
+    top.Add(11, names.Intern("running"), 10);
+    top.Decay();
+  }
+  top.Add(11, names.Intern("running"), 10);
+  std::vector<std::string> lines = Lines(top, names, 10);
+  CHECK_EQ(lines.size(), 5u);
+  CHECK_EQ(lines[2], "100.0%  running");
+  CHECK_EQ(lines[3], "Thread 11 (100.0%):");
+  CHECK_EQ(lines[4], "100.0%  running");
+}
+
+int main() { return RunTests(); }
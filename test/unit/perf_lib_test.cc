@@ -0,0 +1,94 @@
+#include "perf_lib.hh"
+
+#include "check.hh"
+
+static EventConfig Parse(const std::string &spec, bool *parsed) {
+  EventConfig config;
+  *parsed = ParseEventSpec(spec, &config);
+  return config;
+}
+
+TEST(DefaultEventIsRefCycles) {
+  EventConfig config;
+  CHECK_EQ(EventName(config), "ref-cycles");
+  CHECK_EQ(std::string(EventUnit(config)), "cycles");
+}
+
+TEST(NamedEventsParse) {
+  bool parsed;
+  EventConfig config = Parse("instructions", &parsed);
+  CHECK(parsed);
+  CHECK_EQ(config.type, uint32_t(PERF_TYPE_HARDWARE));
+  CHECK_EQ(config.config, uint64_t(PERF_COUNT_HW_INSTRUCTIONS));
+
+  config = Parse("task-clock", &parsed);
+  CHECK(parsed);
+  CHECK_EQ(config.type, uint32_t(PERF_TYPE_SOFTWARE));
+  CHECK_EQ(config.config, uint64_t(PERF_COUNT_SW_TASK_CLOCK));
+}
+
+TEST(NamedEventsRoundTrip) {
+  const char *names[] = {"cycles", "cache-misses", "stalled-cycles-backend",
+                         "cpu-clock", "page-faults", "context-switches"};
+  for (const char *name : names) {
+    bool parsed;
+    EventConfig config = Parse(name, &parsed);
+    CHECK(parsed);
+    CHECK_EQ(EventName(config), name);
+  }
+}
+
+TEST(RawEventsParse) {
+  bool parsed;
+  EventConfig config = Parse("4:0x1c2", &parsed);
+  CHECK(parsed);
+  CHECK_EQ(config.type, 4u);
+  CHECK_EQ(config.config, 0x1c2u);
+  CHECK_EQ(EventName(config), "4:450");
+
+  config = Parse("1:2", &parsed);
+  CHECK(parsed);
+  CHECK_EQ(EventName(config), "page-faults");
+}
+
+TEST(MalformedSpecsAreRejected) {
+  const char *specs[] = {"",       "cycle",    "4:",     ":12",
+                         "4:12x",  "4:0xzz",   "Cycles", "../../x:id",
+                         "sched:..", "sched/../x:y"};
+  for (const char *spec : specs) {
+    bool parsed;
+    EventConfig config = Parse(spec, &parsed);
+    CHECK(!parsed);
+    // The event to sample is left as it was
+    EventConfig unchanged;
+    CHECK_EQ(config.type, unchanged.type);
+    CHECK_EQ(config.config, unchanged.config);
+  }
+}
+
+TEST(UnknownTracepointsAreRejected) {
+  bool parsed;
+  Parse("no_such_subsystem:no_such_event", &parsed);
+  CHECK(!parsed);
+}
+
+TEST(TracepointsAreNamedById) {
+  EventConfig config;
+  config.type = PERF_TYPE_TRACEPOINT;
+  config.config = 321;
+  CHECK_EQ(EventName(config), "tracepoint 321");
+  CHECK_EQ(std::string(EventUnit(config)), "events");
+}
+
+TEST(UnitsFollowTheEvent) {
+  bool parsed;
+  CHECK_EQ(std::string(EventUnit(Parse("cycles", &parsed))), "cycles");
+  CHECK_EQ(std::string(EventUnit(Parse("bus-cycles", &parsed))), "cycles");
+  CHECK_EQ(std::string(EventUnit(Parse("cpu-clock", &parsed))), "ns");
+  CHECK_EQ(std::string(EventUnit(Parse("task-clock", &parsed))), "ns");
+  CHECK_EQ(std::string(EventUnit(Parse("instructions", &parsed))), "events");
+  CHECK_EQ(std::string(EventUnit(Parse("page-faults", &parsed))), "events");
+  CHECK_EQ(std::string(EventUnit(Parse("4:0x1c2", &parsed))), "events");
+}
+
+int main() { return RunTests(); }
@@ -0,0 +1,216 @@
+#include "recording.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "check.hh"
+
+// A temporary file, removed when it goes out of scope
+class TempFile {
+ public:
+  TempFile() {
+    char path[] = "/tmp/recording_test.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    close(fd);
+    path_ = path;
+  }
+  ~TempFile() { unlink(path_.c_str()); }
+
+  const std::string &path() const { return path_; }
+
+  // Overwrite the file with size bytes of data
+  void Replace(const void *data, size_t size) {
+    FILE *file = fopen(path_.c_str(), "w");
+    fwrite(data, 1, size, file);
+    fclose(file);
+  }
+
+ private:
+  std::string path_;
+};
+
+static RecordingHeader Header() {
+  RecordingHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+  header.version = RECORDING_VERSION;
+  header.header_size = sizeof(header);
+  header.sample_period = 10000000;
+  header.child_pid = 1234;
+  header.event_type = PERF_TYPE_SOFTWARE;
+  header.event_config = PERF_COUNT_SW_TASK_CLOCK;
+  return header;
+}
+
+static LostSourceRecord Lost(int32_t tid, uint64_t lost) {
+  LostSourceRecord record;
+  record.header.type = RECORD_LOST_SOURCE;
+  record.header.misc = 0;
+  record.header.size = sizeof(record);
+  record.tid = tid;
+  record.cpu = -1;
+  record.lost = lost;
+  return record;
+}
+
+// Write a recording of the given records through a RecordBuffer, each at
+// the time of its index
+static void Write(const TempFile &file, const RecordingHeader &header,
+                  const std::vector<LostSourceRecord> &records) {
+  RecordingWriter writer;
+  CHECK(writer.Open(file.path(), header));
+  RecordBuffer buffer;
+  for (size_t i = 0; i < records.size(); i++) {
+    buffer.Append(writer, &records[i].header, i);
+  }
+  buffer.Flush(writer);
+  CHECK_EQ(writer.size(),
+           sizeof(header) + records.size() * (sizeof(uint64_t) +
+                                              sizeof(LostSourceRecord)));
+  writer.Close();
+}
+
+// Return the tids of the records of the recording at path, in the order they
+// are replayed
+static std::vector<int32_t> ReplayedTids(const std::string &path) {
+  std::vector<int32_t> tids;
+  RecordingReader reader;
+  CHECK(reader.Open(path));
+  const perf_event_header *record;
+  while ((record = reader.NextRecord()) != NULL) {
+    tids.push_back(reinterpret_cast<const LostSourceRecord *>(record)->tid);
+  }
+  return tids;
+}
+
+TEST(RecordsReadBackAsWritten) {
+  TempFile file;
+  Write(file, Header(), {Lost(10, 1), Lost(11, 2)});
+
+  RecordingReader reader;
+  CHECK(reader.Open(file.path()));
+  CHECK_EQ(reader.header().child_pid, 1234);
+  CHECK_EQ(reader.header().event_type, uint32_t(PERF_TYPE_SOFTWARE));
+  CHECK_EQ(reader.header().event_config,
+           uint64_t(PERF_COUNT_SW_TASK_CLOCK));
+
+  for (int32_t tid = 10; tid <= 11; tid++) {
+    const perf_event_header *record = reader.NextRecord();
+    CHECK(record != NULL);
+    if (record == NULL) return;
+    CHECK_EQ(record->type, RECORD_LOST_SOURCE);
+    const LostSourceRecord *lost =
+        reinterpret_cast<const LostSourceRecord *>(record);
+    CHECK_EQ(lost->tid, tid);
+    CHECK_EQ(lost->lost, uint64_t(tid - 9));
+  }
+  CHECK(reader.NextRecord() == NULL);
+}
+
+TEST(OtherVersionsAreRejected) {
+  // Older versions lack the event or the times of the records, so they
+  // cannot be reported correctly
+  for (uint32_t version : {1u, 2u, 3u, RECORDING_VERSION + 1}) {
+    TempFile file;
+    RecordingHeader header = Header();
+    header.version = version;
+    Write(file, header, {Lost(10, 1)});
+    RecordingReader reader;
+    CHECK(!reader.Open(file.path()));
+  }
+}
+
+TEST(OtherFilesAreRejected) {
+  TempFile file;
+  RecordingHeader header = Header();
+  header.magic[0] = 'X';
+  Write(file, header, {});
+  RecordingReader bad_magic;
+  CHECK(!bad_magic.Open(file.path()));
+
+  // Shorter than a header
+  file.Replace("GPROFREC", 8);
+  RecordingReader short_file;
+  CHECK(!short_file.Open(file.path()));
+
+  // Records would start past the end of the file
+  header = Header();
+  header.header_size = sizeof(header) + 64;
+  file.Replace(&header, sizeof(header));
+  RecordingReader past_end;
+  CHECK(!past_end.Open(file.path()));
+
+  RecordingReader missing;
+  CHECK(!missing.Open(file.path() + ".missing"));
+}
+
+TEST(TruncatedLastRecordIsDropped) {
+  TempFile file;
+  RecordingHeader header = Header();
+  std::string data(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (int32_t tid = 10; tid <= 11; tid++) {
+    uint64_t time = tid;
+    LostSourceRecord record = Lost(tid, 1);
+    data.append(reinterpret_cast<const char *>(&time), sizeof(time));
+    data.append(reinterpret_cast<const char *>(&record), sizeof(record));
+  }
+  data.resize(data.size() - 4);
+  file.Replace(data.data(), data.size());
+
+  RecordingReader reader;
+  CHECK(reader.Open(file.path()));
+  CHECK(reader.NextRecord() != NULL);
+  CHECK(reader.NextRecord() == NULL);
+}
+
+TEST(InterleavedBlocksReplayInTimeOrder) {
+  // Two collectors flush their blocks one after the other, so the mapping
+  // one of them read (at time 20) lands in the file after the samples of the
+  // other that come after it (at 30 and 40). Records are told apart by tid.
+  TempFile file;
+  RecordingWriter writer;
+  CHECK(writer.Open(file.path(), Header()));
+  RecordBuffer first, second;
+  LostSourceRecord records[] = {Lost(10, 1), Lost(30, 1), Lost(40, 1),
+                                Lost(20, 1), Lost(50, 1)};
+  first.Append(writer, &records[0].header, 10);
+  first.Append(writer, &records[1].header, 30);
+  first.Append(writer, &records[2].header, 40);
+  second.Append(writer, &records[3].header, 20);
+  second.Append(writer, &records[4].header, 50);
+  first.Flush(writer);
+  second.Flush(writer);
+  writer.Close();
+
+  std::vector<int32_t> expected = {10, 20, 30, 40, 50};
+  CHECK(ReplayedTids(file.path()) == expected);
+}
+
+TEST(RecordsOfTheSameTimeKeepTheirOrder) {
+  // A collector makes up records (e.g. the mappings of a new process) with
+  // the time of the record it read before them
+  TempFile file;
+  RecordingWriter writer;
+  CHECK(writer.Open(file.path(), Header()));
+  RecordBuffer first, second;
+  LostSourceRecord records[] = {Lost(1, 1), Lost(2, 1), Lost(3, 1),
+                                Lost(4, 1)};
+  second.Append(writer, &records[3].header, 7);
+  first.Append(writer, &records[0].header, 5);
+  first.Append(writer, &records[1].header, 5);
+  first.Append(writer, &records[2].header, 5);
+  second.Flush(writer);
+  first.Flush(writer);
+  writer.Close();
+
+  std::vector<int32_t> expected = {1, 2, 3, 4};
+  CHECK(ReplayedTids(file.path()) == expected);
+}
+
+int main() { return RunTests(); }